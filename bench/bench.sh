@@ -0,0 +1,137 @@
+#!/bin/bash
+#
+# Mount files served by the local stand-in server (bench/httpd.py) and run
+# the workloads of bench/workload.py on them, first with an empty -C cache
+# (cold) and then again on a new mount using the filled cache (warm).
+#
+# usage: bench/bench.sh [httpfs2 binary]    (default ./httpfs2-mt)
+#
+# Settings are taken from the environment:
+#   SIZE_MB     size of the test file (default 64)
+#   LATENCY     milliseconds the server waits before each reply (default 20)
+#   BANDWIDTH   bytes/s per connection, 0 = unlimited (default 0)
+#   STALL       "N MS": every Nth request waits MS milliseconds more
+#   DROP        every DROPth response is cut off halfway through the body
+#   MD5=1       server sends X-MD5
+#   REDIRECT=1  requests go to a master server redirecting to a mirror
+#   TLS=1       https with a self signed certificate, needs an -ssl binary
+#   PORT        first port used by the servers (default 18400)
+#   MODES       workloads to run (default "seq rand4k rand128k parallel squashfs")
+#               squashfs needs mksquashfs and root for the loop mount
+#   OPTS        extra httpfs2 options
+
+BIN=$(realpath "${1:-./httpfs2-mt}")
+SIZE_MB=${SIZE_MB:-64}
+LATENCY=${LATENCY:-20}
+BANDWIDTH=${BANDWIDTH:-0}
+PORT=${PORT:-18400}
+MODES=${MODES:-"seq rand4k rand128k parallel squashfs"}
+HERE=$(dirname "$(realpath "$0")")
+
+[ -x "$BIN" ] || { echo "$BIN: not found, build it first" >&2; exit 1; }
+
+WORK=$(mktemp -d /tmp/httpfs2-bench.XXXXXX)
+DATA=$WORK/data
+MNT=$WORK/mnt
+SQMNT=$WORK/squashfs
+mkdir -p "$DATA" "$MNT" "$SQMNT"
+PIDS=
+
+cleanup() {
+    mountpoint -q "$SQMNT" && umount "$SQMNT"
+    mountpoint -q "$MNT" && fusermount -u "$MNT"
+    [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+    wait 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+# test data
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom > "$DATA/file.bin"
+case " $MODES " in *" squashfs "*)
+    if command -v mksquashfs >/dev/null && [ "$(id -u)" = 0 ]; then
+        mkdir -p "$WORK/tree"
+        for d in $(seq 1 16); do
+            mkdir -p "$WORK/tree/d$d"
+            for f in $(seq 1 32); do
+                head -c $((RANDOM * 4)) /dev/urandom > "$WORK/tree/d$d/f$f"
+            done
+        done
+        mksquashfs "$WORK/tree" "$DATA/tree.sqfs" -quiet -noappend >/dev/null
+    else
+        echo "squashfs walk skipped: needs mksquashfs and root" >&2
+        MODES=${MODES/squashfs/}
+    fi
+esac
+
+# servers
+SERVER_OPTS="--root $DATA --latency $LATENCY --bandwidth $BANDWIDTH"
+[ "$MD5" = 1 ] && SERVER_OPTS="$SERVER_OPTS --md5"
+[ -n "$STALL" ] && SERVER_OPTS="$SERVER_OPTS --stall $STALL"
+[ -n "$DROP" ] && SERVER_OPTS="$SERVER_OPTS --drop $DROP"
+SCHEME=http
+HOST=127.0.0.1
+if [ "$TLS" = 1 ]; then
+    openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=localhost \
+        -addext subjectAltName=DNS:localhost \
+        -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null
+    SERVER_OPTS="$SERVER_OPTS --tls $WORK/cert.pem $WORK/key.pem"
+    OPTS="$OPTS -a $WORK/cert.pem"
+    SCHEME=https
+    HOST=localhost
+fi
+python3 "$HERE/httpd.py" $SERVER_OPTS --port $PORT & PIDS="$PIDS $!"
+SERVERS=$PORT
+if [ "$REDIRECT" = 1 ]; then
+    python3 "$HERE/httpd.py" $SERVER_OPTS --port $((PORT + 1)) \
+        --redirect $SCHEME://$HOST:$PORT & PIDS="$PIDS $!"
+    SERVERS="$PORT $((PORT + 1))"
+    PORT=$((PORT + 1))
+fi
+sleep 1
+
+server_requests() {
+    local n=0 p
+    for p in $SERVERS; do
+        n=$((n + $(curl -sk $SCHEME://$HOST:$p/.bench-requests)))
+    done
+    echo $n
+}
+
+stat_value() {
+    awk -v k=$1 '$1 == k { print $2 }' "$MNT/.httpfs-stats"
+}
+
+printf "%-5s %-9s %9s %9s %9s %7s %9s %9s\n" cache mode MB/s p50_ms p99_ms ops requests cache_hits
+echo "$SCHEME://$HOST:$PORT/file.bin file.bin" > "$WORK/list"
+[ -f "$DATA/tree.sqfs" ] && echo "$SCHEME://$HOST:$PORT/tree.sqfs tree.sqfs" >> "$WORK/list"
+for mode in $MODES; do
+    rm -f "$WORK/cache" "$WORK/cache.idx"
+    for cache in cold warm; do
+        "$BIN" -c -f -v 1 -C "$WORK/cache" -l "$WORK/list" $OPTS "$MNT" \
+            2>>"$WORK/httpfs2.log" & mount_pid=$!
+        for i in $(seq 50); do
+            mountpoint -q "$MNT" && break
+            sleep 0.1
+        done
+        mountpoint -q "$MNT" || { echo "mount failed, see log:" >&2; cat "$WORK/httpfs2.log" >&2; exit 1; }
+        before=$(server_requests)
+        if [ $mode = squashfs ]; then
+            mount -o loop,ro "$MNT/tree.sqfs" "$SQMNT"
+            result=$(python3 "$HERE/workload.py" walk "$SQMNT")
+            umount "$SQMNT"
+        else
+            result=$(python3 "$HERE/workload.py" $mode "$MNT/file.bin")
+        fi
+        requests=$(( $(server_requests) - before - $(echo $SERVERS | wc -w) ))
+        hits=$(stat_value cache_hits)
+        fusermount -u "$MNT"
+        wait $mount_pid
+        echo "$result" | python3 -c '
+import json, sys
+r = json.load(sys.stdin)
+print("%-5s %-9s %9.1f %9.3f %9.3f %7d %9s %9s" % (sys.argv[1], sys.argv[2],
+      r["bytes"] / 1048576 / max(r["seconds"], 1e-9), r["p50_ms"], r["p99_ms"],
+      r["ops"], sys.argv[3], sys.argv[4]))' $cache $mode $requests "$hits"
+    done
+done
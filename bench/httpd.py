@@ -0,0 +1,167 @@
+#!/usr/bin/env python3
+#
+# HTTP/1.1 range server standing in for the master/mirror setup httpfs2
+# is used with. Serves the files below --root with Range, HEAD,
+# keepalive, ETag, If-Range and If-None-Match support and can add latency
+# and a bandwidth limit per connection to resemble a remote server.
+#
+# --md5        send X-MD5 with the digest of the returned range
+# --redirect   answer with 302 to the same path below this url (the
+#              mirror) and put X-MD5 into the redirect like the master does
+# --tls        serve https with the given certificate and key files
+# --stall      make every Nth request wait MS milliseconds more, a slow tail
+# --drop       close the connection of every Nth request halfway through the body
+#
+# GET /.bench-requests returns the number of requests served so far.
+
+import argparse
+import hashlib
+import http.server
+import os
+import re
+import socketserver
+import ssl
+import threading
+import time
+
+requests = 0
+requests_lock = threading.Lock()
+
+
+class Handler(http.server.BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    server_version = "httpfs2-bench"
+
+    def log_message(self, fmt, *args):
+        if self.server.opts.verbose:
+            super().log_message(fmt, *args)
+
+    def delay(self, count):
+        if self.server.opts.latency:
+            time.sleep(self.server.opts.latency / 1000.0)
+        stall = self.server.opts.stall
+        if stall and count % stall[0] == 0:
+            time.sleep(stall[1] / 1000.0)
+
+    def send_body(self, data):
+        rate = self.server.opts.bandwidth
+        if not rate:
+            self.wfile.write(data)
+            return
+        chunk = max(1024, rate // 100)
+        start = time.monotonic()
+        for off in range(0, len(data), chunk):
+            self.wfile.write(data[off:off + chunk])
+            ahead = (off + chunk) / rate - (time.monotonic() - start)
+            if ahead > 0:
+                time.sleep(ahead)
+
+    def file_range(self):
+        path = os.path.normpath(self.path.split("?", 1)[0]).lstrip("/")
+        name = os.path.join(self.server.opts.root, path)
+        if not os.path.isfile(name):
+            return None, None, None, None
+        size = os.path.getsize(name)
+        start, end = 0, size - 1
+        m = re.match(r"bytes=(\d+)-(\d*)", self.headers.get("Range", ""))
+        if m:
+            start = int(m.group(1))
+            if m.group(2):
+                end = min(int(m.group(2)), size - 1)
+        return name, size, start, end
+
+    def do_HEAD(self):
+        self.handle_request(False)
+
+    def do_GET(self):
+        self.handle_request(True)
+
+    def handle_request(self, body):
+        global requests
+        with requests_lock:
+            requests += 1
+            count = requests
+        if self.path == "/.bench-requests":
+            data = b"%d\n" % count
+            self.send_response(200)
+            self.send_header("Content-Length", str(len(data)))
+            self.end_headers()
+            self.wfile.write(data)
+            return
+        self.delay(count)
+        name, size, start, end = self.file_range()
+        if name is None:
+            self.send_error(404)
+            return
+        st = os.stat(name)
+        etag = '"%x-%x"' % (st.st_size, st.st_mtime_ns)
+        ranged = "Range" in self.headers
+        if ranged and self.headers.get("If-Range", etag) != etag:
+            ranged = False
+            start, end = 0, size - 1
+        if not ranged and self.headers.get("If-None-Match") == etag:
+            self.send_response(304)
+            self.send_header("ETag", etag)
+            self.end_headers()
+            return
+        data = b""
+        if body or self.server.opts.md5:
+            with open(name, "rb") as f:
+                f.seek(start)
+                data = f.read(end - start + 1)
+        if self.server.opts.redirect:
+            self.send_response(302)
+            self.send_header("Location", self.server.opts.redirect.rstrip("/") + self.path)
+            if ranged:
+                self.send_header("X-MD5", hashlib.md5(data).hexdigest())
+            self.send_header("Content-Length", "0")
+            self.end_headers()
+            return
+        self.send_response(206 if ranged else 200)
+        self.send_header("Content-Length", str(end - start + 1))
+        self.send_header("Accept-Ranges", "bytes")
+        self.send_header("Last-Modified", self.date_time_string(st.st_mtime))
+        self.send_header("ETag", etag)
+        if ranged:
+            self.send_header("Content-Range", "bytes %d-%d/%d" % (start, end, size))
+        if self.server.opts.md5 and ranged:
+            self.send_header("X-MD5", hashlib.md5(data).hexdigest())
+        self.end_headers()
+        if body and self.server.opts.drop and count % self.server.opts.drop == 0:
+            self.send_body(data[:len(data) // 2])
+            self.close_connection = True
+            return
+        if body:
+            self.send_body(data)
+
+
+class Server(socketserver.ThreadingMixIn, http.server.HTTPServer):
+    daemon_threads = True
+    allow_reuse_address = True
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument("--root", default=".")
+    p.add_argument("--port", type=int, default=8080)
+    p.add_argument("--latency", type=float, default=0, help="milliseconds per request")
+    p.add_argument("--bandwidth", type=int, default=0, help="bytes/s per connection")
+    p.add_argument("--md5", action="store_true")
+    p.add_argument("--redirect", metavar="URL")
+    p.add_argument("--tls", nargs=2, metavar=("CERT", "KEY"))
+    p.add_argument("--stall", nargs=2, type=int, metavar=("N", "MS"))
+    p.add_argument("--drop", type=int, metavar="N")
+    p.add_argument("--verbose", action="store_true")
+    opts = p.parse_args()
+
+    server = Server(("127.0.0.1", opts.port), Handler)
+    server.opts = opts
+    if opts.tls:
+        ctx = ssl.SSLContext(ssl.PROTOCOL_TLS_SERVER)
+        ctx.load_cert_chain(*opts.tls)
+        server.socket = ctx.wrap_socket(server.socket, server_side=True)
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()
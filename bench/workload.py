@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# Read workloads run against files in an httpfs2 mount. Every read is
+# timed and one line of JSON is printed per run:
+#   {"mode": ..., "bytes": ..., "seconds": ..., "ops": ..., "p50_ms": ..., "p99_ms": ...}
+#
+#   seq FILE        read the file front to back in --block sized reads
+#   rand4k FILE     --count random 4K reads
+#   rand128k FILE   --count random 128K reads
+#   parallel FILE   --threads readers each reading its own part of the file
+#   walk DIR        read every file below DIR, e.g. a loop mounted squashfs
+
+import argparse
+import json
+import os
+import random
+import sys
+import threading
+import time
+
+
+def timed_reads(fd, ranges, lat):
+    total = 0
+    for off, size in ranges:
+        t = time.perf_counter()
+        total += len(os.pread(fd, size, off))
+        lat.append(time.perf_counter() - t)
+    return total
+
+
+def file_reads(name, ranges, lat):
+    fd = os.open(name, os.O_RDONLY)
+    try:
+        return timed_reads(fd, ranges, lat)
+    finally:
+        os.close(fd)
+
+
+def seq_ranges(start, end, block):
+    return [(off, min(block, end - off)) for off in range(start, end, block)]
+
+
+def rand_ranges(size, block, count, rnd):
+    return [(rnd.randrange(0, max(1, size - block)) // block * block, block)
+            for _ in range(count)]
+
+
+def run(opts):
+    lat = []
+    rnd = random.Random(opts.seed)
+    start = time.perf_counter()
+    if opts.mode == "walk":
+        total = 0
+        for root, dirs, names in os.walk(opts.path):
+            dirs.sort()
+            for n in sorted(names):
+                name = os.path.join(root, n)
+                if os.path.isfile(name) and not os.path.islink(name):
+                    size = os.path.getsize(name)
+                    total += file_reads(name, seq_ranges(0, size, opts.block), lat)
+    else:
+        size = os.path.getsize(opts.path)
+        if opts.mode == "seq":
+            total = file_reads(opts.path, seq_ranges(0, size, opts.block), lat)
+        elif opts.mode in ("rand4k", "rand128k"):
+            block = 4096 if opts.mode == "rand4k" else 131072
+            total = file_reads(opts.path, rand_ranges(size, block, opts.count, rnd), lat)
+        else:
+            part = size // opts.threads
+            results = [0] * opts.threads
+            lats = [[] for _ in range(opts.threads)]
+
+            def reader(i):
+                end = size if i == opts.threads - 1 else (i + 1) * part
+                results[i] = file_reads(opts.path, seq_ranges(i * part, end, opts.block), lats[i])
+
+            threads = [threading.Thread(target=reader, args=(i,)) for i in range(opts.threads)]
+            for t in threads:
+                t.start()
+            for t in threads:
+                t.join()
+            total = sum(results)
+            for l in lats:
+                lat.extend(l)
+    seconds = time.perf_counter() - start
+    lat.sort()
+
+    def pct(p):
+        return round(lat[min(len(lat) - 1, int(len(lat) * p))] * 1000, 3) if lat else 0
+
+    return {"mode": opts.mode, "bytes": total, "seconds": round(seconds, 3),
+            "ops": len(lat), "p50_ms": pct(0.50), "p99_ms": pct(0.99)}
+
+
+def main():
+    p = argparse.ArgumentParser()
+    p.add_argument("mode", choices=["seq", "rand4k", "rand128k", "parallel", "walk"])
+    p.add_argument("path")
+    p.add_argument("--block", type=int, default=131072, help="read size of seq, parallel and walk")
+    p.add_argument("--count", type=int, default=256, help="number of random reads")
+    p.add_argument("--threads", type=int, default=4)
+    p.add_argument("--seed", type=int, default=1)
+    json.dump(run(p.parse_args()), sys.stdout)
+    print()
+
+
+if __name__ == "__main__":
+    main()
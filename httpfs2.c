@@ -25,6 +25,12 @@
 
 #define FUSE_USE_VERSION 26
 
+/* Linux specific memory and socket interfaces. Builds for old libc
+ * providing their own strndup stay with plain X/Open. */
+#ifndef NEED_STRNDUP
+#define _GNU_SOURCE
+#endif
+
 #include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -39,24 +45,55 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <poll.h>
 #include <time.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
 
 #ifdef USE_THREAD
 #include <pthread.h>
+#include <semaphore.h>
 static pthread_key_t url_key;
 pthread_mutex_t cache_lock;
+pthread_mutex_t files_lock;
 #define FUSE_LOOP fuse_session_loop_mt
 #else
-#define FUSE_LOOP fuse_session_loop
+#define FUSE_LOOP inval_loop
 #endif
 
 #ifdef USE_SSL
 #include <gnutls/gnutls.h>
 #include <gnutls/x509.h>
+#include <gnutls/socket.h>
+#ifdef __linux__
+#include <netinet/tcp.h>
+#include <linux/tls.h>
+#define USE_KTLS
+#ifndef TCP_ULP
+#define TCP_ULP 31
+#endif
+#ifndef SOL_TLS
+#define SOL_TLS 282
+#endif
+#endif
+#endif
+
+#ifdef USE_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef USE_LZ4
+#include <lz4.h>
+#endif
+#ifdef USE_ZSTD
+#include <zstd.h>
 #endif
 
 /*
@@ -70,10 +107,11 @@ pthread_mutex_t cache_lock;
 #define TIMEOUT 30
 #define CONSOLE "/dev/console"
 #define HEADER_SIZE 1024
-#define MAX_REQUEST (32*1024)
+#define VALIDATOR_LEN 72 /* longest ETag or Last-Modified kept */
 #define MAX_REDIRECTS 32
 #define TNAME_LEN 13
 #define RESET_RETRIES 8
+#define RESET_BACKOFF_MS 1000
 #define VERSION "0.1.5 \"The Message\""
 
 enum sock_state {
@@ -88,6 +126,8 @@ enum url_flags {
     URL_DROP,
 };
 
+typedef struct stats struct_stats;
+
 typedef struct url {
     int proto;
     long timeout;
@@ -108,46 +148,443 @@ typedef struct url {
     int redirected;
     int redirect_followed;
     int redirect_depth;
+    int redirect_cached; /* redirect taken from the cache, stays until dropped */
+    int redirect_md5; /* the master sends X-MD5 so the mirror must too */
+    time_t redirect_expires;
 #ifdef USE_SSL
     long ssl_log_level;
     unsigned md5;
     unsigned md2;
-    int ssl_initialized;
     int ssl_connected;
-    gnutls_certificate_credentials_t sc;
+    int ktls; /* the kernel decrypts received records (-K) */
     gnutls_session_t ss;
     const char * cafile;
 #endif
+    int sched; /* class of the requests made with the url, see sched_enter() */
+    int sched_depth; /* sched_enter() calls not left yet */
+    uint64_t rtt; /* smoothed time to first byte in microseconds, -A */
+    uint64_t rate; /* smoothed bytes per second of response bodies, -A */
+    uint64_t io_timeout; /* receive timeout set on the socket, microseconds */
     char * req_buf;
     size_t req_buf_size;
+    struct_stats * stats; /*counters of the thread using the url*/
+    fuse_ino_t ino; /*inode of the file in the mount*/
+    uint64_t fileid; /*identifies the file in the shared cache*/
+    uint64_t filecheck; /*rest of the location digest, catches fileid collisions*/
     off_t file_size;
     time_t last_modified;
     char tname[TNAME_LEN + 1];
     char xmd5[33];
+    char validator[VALIDATOR_LEN]; /* strong ETag or Last-Modified of the last reply */
+    int conditional; /* the request carried the validator of the file */
+    int not_modified; /* and was answered with 304 */
+    int range_changed; /* If-Range did not match, the file changed during the exchange */
+    int own_socket; /* never takes over a keepalive socket, see hedge() */
 } struct_url;
 
+// ========== LOGGING ============
+/*
+ * Messages up to log_level (-v, SIGUSR2 steps through the levels) are
+ * formatted into a ring and written to stderr by a background thread, so
+ * the read path does not wait for the console which is opened O_SYNC.
+ * Messages above the level are not even formatted. Producers claim lines
+ * with compare-and-swap, when the ring is full messages are dropped and
+ * counted. Before the log thread is started, and in builds without
+ * threads, messages are written directly.
+ */
+enum log_level {
+    L_ERROR,
+    L_WARN,
+    L_INFO,
+    L_DEBUG,
+};
+#define LOG_LEVEL L_INFO
+#define LOG_LINE (HEADER_SIZE + 256)
+#define LOG_RING 256 /* lines */
+
+static volatile int log_level = LOG_LEVEL;
+
+#define log_msg(level, ...) do { \
+    if ((level) <= log_level) log_printf(__VA_ARGS__); \
+} while (0)
+
+static void log_write(const char *text, size_t len)
+{
+    while (len > 0) {
+        ssize_t res = write(2, text, len);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        text += res;
+        len -= (size_t)res;
+    }
+}
+
+static void trace_poll(void); /* the SIGUSR1 trace dump, written by the log thread */
+
+#ifdef USE_THREAD
+typedef struct {
+    volatile int ready;
+    size_t len;
+    char text[LOG_LINE];
+} struct_log_line;
+
+static struct_log_line * log_ring = NULL;
+static volatile unsigned long log_head = 0, log_tail = 0, log_dropped = 0;
+static volatile int log_stop = 0;
+static sem_t log_sem;
+static pthread_t log_thread;
+
+static void * log_flush(void * arg)
+{
+    unsigned long dropped = 0;
+    (void) arg;
+    while (1) {
+        while (log_tail != log_head) {
+            struct_log_line * l = &log_ring[log_tail % LOG_RING];
+            if (!l->ready)
+                break; /* still being formatted, its sem_post follows */
+            __sync_synchronize();
+            log_write(l->text, l->len);
+            l->ready = 0;
+            __sync_synchronize();
+            log_tail++;
+        }
+        if (log_dropped != dropped) {
+            char text[64];
+            int len = snprintf(text, sizeof(text), "log: %lu messages dropped.\n",
+                    log_dropped - dropped);
+            dropped = log_dropped;
+            log_write(text, (size_t)len);
+        }
+        trace_poll();
+        if (log_stop && log_tail == log_head)
+            return NULL;
+        sem_wait(&log_sem);
+    }
+}
+
+static void log_start(void)
+{
+    log_ring = calloc(LOG_RING, sizeof(struct_log_line));
+    sem_init(&log_sem, 0, 0);
+    if (pthread_create(&log_thread, NULL, log_flush, NULL)) {
+        free(log_ring);
+        log_ring = NULL;
+    }
+}
+
+static void log_finish(void)
+{
+    if (!log_ring)
+        return;
+    log_stop = 1;
+    sem_post(&log_sem);
+    pthread_join(log_thread, NULL);
+}
+#else
+static void log_start(void) { }
+static void log_finish(void) { }
+#endif
+
+static void log_printf(const char * fmt, ...) __attribute__ ((format (printf, 1, 2)));
+static void log_printf(const char * fmt, ...)
+{
+    va_list ap;
+    int len;
+#ifdef USE_THREAD
+    if (log_ring) {
+        struct_log_line * l;
+        unsigned long head;
+        do {
+            head = log_head;
+            if (head - log_tail >= LOG_RING) {
+                __sync_fetch_and_add(&log_dropped, 1);
+                return;
+            }
+        } while (!__sync_bool_compare_and_swap(&log_head, head, head + 1));
+        l = &log_ring[head % LOG_RING];
+        va_start(ap, fmt);
+        len = vsnprintf(l->text, LOG_LINE, fmt, ap);
+        va_end(ap);
+        l->len = len < 0 ? 0 : len < LOG_LINE ? (size_t)len : LOG_LINE - 1;
+        __sync_synchronize();
+        l->ready = 1;
+        sem_post(&log_sem);
+        return;
+    }
+#endif
+    {
+        char text[LOG_LINE];
+        va_start(ap, fmt);
+        len = vsnprintf(text, LOG_LINE, fmt, ap);
+        va_end(ap);
+        log_write(text, len < 0 ? 0 : len < LOG_LINE ? (size_t)len : LOG_LINE - 1);
+    }
+}
+
+static void log_signal(int sig)
+{
+    (void) sig;
+    log_level = (log_level + 1) % (L_DEBUG + 1);
+}
+
 // ========== CACHE  ============
 #define CACHEMAXSIZE 2147483648LL
 #define CRCLEN 32
+#define IDX_MAGIC 0x58444948 /* "HIDX" */
+#define IDX_VERSION 5
 typedef struct range struct_range;
 typedef struct range {
+    uint64_t fileid;
     off_t start;
     size_t size;
     off_t cstart;
     char md5[33];
-//    sizef_t csize; // actually, the same as size
+    int stale; /* of an old version of the file, see delta_reuse() */
+    size_t csize; /* stored length, the same as size when not compressed */
+    int codec;
     struct_range *next;
 } struct_range;
 
 struct_range *idxhead = 0, *lastidx = 0;
+
+/*
+ * The validator each file was last seen with, stored in the index so the
+ * cached blocks of a file are dropped together when it changes and a
+ * HEAD at startup can be answered with 304. Known only for files read
+ * from the server a url points to, mirrors may not agree on ETags.
+ * Every file with cached blocks has one, its check tells the files apart
+ * when two locations hash to the same fileid, see validator_claim().
+ */
+typedef struct validator struct_validator;
+struct validator {
+    uint64_t fileid;
+    uint64_t check;
+    off_t size; /* -1 until a HEAD was answered */
+    time_t mtime;
+    char tag[VALIDATOR_LEN]; /* "" after the file changed */
+    struct_validator * next;
+};
+static struct_validator * validators = NULL;
+static struct_validator * validator_find(struct_url * url);
+static char * digest_suffix = NULL; /* -m */
 int fdcache = 0, fdidx = 0; // cache files descriptors are global for all theads
 off_t cacheMaxSize = CACHEMAXSIZE; // default cache file size
 //size_t cacheMaxSize = 327680; // debug
 
+/*
+ * The reads of a cached block and the writes of a block and of the index
+ * are each done as one batch of positioned I/O. With io_uring (make
+ * all-uring) a batch is submitted with one system call, the index write
+ * linked to the block write so it is skipped when the block write fails.
+ * Batches are only issued under cache_lock so the ring needs no locking.
+ */
+typedef struct {
+    int fd;
+    int write;
+    struct iovec * iov;
+    int iovcnt;
+    off_t off;
+    ssize_t res;
+} struct_cache_io;
+
+#ifdef USE_URING
+#define URING_ENTRIES 8
+
+static struct {
+    int fd;
+    unsigned * sq_tail, * sq_mask, * sq_array;
+    unsigned * cq_head, * cq_tail, * cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+} uring = { -1, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+static int uring_init(void)
+{
+    struct io_uring_params p;
+    char * sq, * cq;
+    size_t sq_size, cq_size;
+
+    memset(&p, 0, sizeof(p));
+    uring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (uring.fd < 0)
+        return -1;
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+            uring.fd, IORING_OFF_SQ_RING);
+    cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq : mmap(NULL, cq_size,
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_CQ_RING);
+    uring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+            PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, uring.fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || uring.sqes == MAP_FAILED) {
+        close(uring.fd);
+        uring.fd = -1;
+        return -1;
+    }
+    uring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    uring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    uring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    uring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    uring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    uring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    uring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static int uring_io(struct_cache_io * io, int n, int linked)
+{
+    unsigned tail = *uring.sq_tail, head;
+    int i, done;
+
+    for (i = 0; i < n; i++, tail++) {
+        unsigned idx = tail & *uring.sq_mask;
+        struct io_uring_sqe * sqe = &uring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = io[i].write ? IORING_OP_WRITEV : IORING_OP_READV;
+        sqe->fd = io[i].fd;
+        sqe->addr = (uint64_t)(uintptr_t)io[i].iov;
+        sqe->len = (unsigned)io[i].iovcnt;
+        sqe->off = (uint64_t)io[i].off;
+        sqe->user_data = (unsigned)i;
+        if (linked && i < n - 1)
+            sqe->flags = IOSQE_IO_LINK;
+        uring.sq_array[idx] = idx;
+        io[i].res = -ECANCELED;
+    }
+    __atomic_store_n(uring.sq_tail, tail, __ATOMIC_RELEASE);
+    if (syscall(__NR_io_uring_enter, uring.fd, n, n, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        return -1;
+    head = *uring.cq_head;
+    for (done = 0; done < n; done++, head++) {
+        struct io_uring_cqe * cqe;
+        while (head == __atomic_load_n(uring.cq_tail, __ATOMIC_ACQUIRE))
+            if (syscall(__NR_io_uring_enter, uring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+                    && errno != EINTR)
+                return -1;
+        cqe = &uring.cqes[head & *uring.cq_mask];
+        if (cqe->user_data < (uint64_t)n)
+            io[cqe->user_data].res = cqe->res;
+    }
+    __atomic_store_n(uring.cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
+
+/* Returns the number of operations that transferred everything */
+static int cache_io(struct_cache_io * io, int n, int linked)
+{
+    int i, ok = 0;
+
+#ifdef USE_URING
+    if (uring.fd < 0 || uring_io(io, n, linked) < 0)
+#endif
+    for (i = 0; i < n; i++) {
+        io[i].res = io[i].write ? pwritev(io[i].fd, io[i].iov, io[i].iovcnt, io[i].off)
+            : preadv(io[i].fd, io[i].iov, io[i].iovcnt, io[i].off);
+        if (linked && io[i].res < 0)
+            break;
+    }
+    for (i = 0; i < n; i++) {
+        size_t len = 0;
+        int j;
+        for (j = 0; j < io[i].iovcnt; j++)
+            len += io[i].iov[j].iov_len;
+        if (io[i].res == (ssize_t)len)
+            ok++;
+    }
+    return ok;
+}
+
+/*
+ * With -z each block is compressed before it is written to the cache
+ * file so more of the files fit into -S. A block that does not get
+ * smaller is stored as it is. The codec is kept per block in the index,
+ * a block of a codec not built in reads as corrupted and is dropped.
+ */
+enum { CODEC_NONE, CODEC_LZ4, CODEC_ZSTD };
+static int cache_codec = CODEC_NONE; /* -z */
+#define ZSTD_LEVEL 1
+/* compressed blocks read from the cache file, cache_lock held */
+static char * codec_buf = NULL;
+static size_t codec_buf_size = 0;
+
+/* The codec of a -z name, -1 when it is not built in */
+static int codec_find(const char * name)
+{
+#ifdef USE_LZ4
+    if (!strcmp(name, "lz4")) return CODEC_LZ4;
+#endif
+#ifdef USE_ZSTD
+    if (!strcmp(name, "zstd")) return CODEC_ZSTD;
+#endif
+    (void) name;
+    return -1;
+}
+
+/* Room needed to compress len bytes */
+static size_t codec_bound(int codec, size_t len)
+{
+    switch (codec) {
+#ifdef USE_LZ4
+    case CODEC_LZ4: return (size_t)LZ4_compressBound((int)len);
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD: return ZSTD_compressBound(len);
+#endif
+    }
+    return len;
+}
+
+/* Returns the compressed length, 0 when the block did not get smaller */
+static size_t codec_compress(int codec, const char * src, size_t len, char * dst, size_t room)
+{
+    size_t n = 0;
+
+    switch (codec) {
+#ifdef USE_LZ4
+    case CODEC_LZ4: {
+        int r = LZ4_compress_default(src, dst, (int)len, (int)room);
+        n = r > 0 ? (size_t)r : 0;
+        break;
+    }
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD:
+        n = ZSTD_compress(dst, room, src, len, ZSTD_LEVEL);
+        if (ZSTD_isError(n)) n = 0;
+        break;
+#endif
+    }
+    (void) src; (void) dst; (void) room;
+    return n < len ? n : 0;
+}
+
+/* Returns 0 when the block came out with exactly len bytes */
+static int codec_decompress(int codec, const char * src, size_t clen, char * dst, size_t len)
+{
+    switch (codec) {
+#ifdef USE_LZ4
+    case CODEC_LZ4:
+        return LZ4_decompress_safe(src, dst, (int)clen, (int)len) == (int)len ? 0 : -1;
+#endif
+#ifdef USE_ZSTD
+    case CODEC_ZSTD:
+        return ZSTD_decompress(dst, len, src, clen) == len ? 0 : -1;
+#endif
+    }
+    (void) src; (void) clen; (void) dst; (void) len;
+    return -1;
+}
+
 int init_cache(char *filename) {
     off_t s;
     struct_range *p = 0;
-    int i, c, l;
+    int i, c, l, magic = 0, version = 0;
     if ((fdcache = open(filename, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR)) == -1) {
         fprintf(stderr, "Can't open cache file: %s\n", filename);
         return -1;
@@ -158,9 +595,20 @@ int init_cache(char *filename) {
         close(fdcache);
         return -1;
     }
+#ifdef USE_URING
+    if (uring_init())
+        fprintf(stderr, "io_uring not available (%s), using plain system calls for the cache\n", strerror(errno));
+#endif
     s = lseek(fdidx, 0, SEEK_END);
     if ( s == 0 ) return 0; // nothing caches yet
     lseek(fdidx, 0, SEEK_SET);
+    read(fdidx, &magic, sizeof(magic));
+    read(fdidx, &version, sizeof(version));
+    if (magic != IDX_MAGIC || version != IDX_VERSION) {
+        fprintf(stderr, "Cache index %s has old format, starting with empty cache\n", filename);
+        ftruncate(fdidx, 0);
+        return 0;
+    }
     read(fdidx, &c, sizeof(c)); // number of entries
     read(fdidx, &l, sizeof(l)); // lask block index
 
@@ -172,13 +620,30 @@ int init_cache(char *filename) {
             p = p->next;
         }
         if (i==l) lastidx = p;
+        read(fdidx, &p->fileid, sizeof(p->fileid));
         read(fdidx, &p->start, sizeof(p->start));
         read(fdidx, &p->size, sizeof(p->size));
         read(fdidx, &p->cstart, sizeof(p->cstart));
+        read(fdidx, &p->csize, sizeof(p->csize));
+        read(fdidx, &p->codec, sizeof(p->codec));
         read(fdidx, &p->md5, CRCLEN);
         p->md5[32] = 0;
+        p->stale = 0;
         p->next = 0;
     }
+    if (read(fdidx, &c, sizeof(c)) != sizeof(c)) // number of validators
+        c = 0;
+    for (i = 0; i < c; i++) {
+        struct_validator * v = malloc(sizeof(struct_validator));
+        read(fdidx, &v->fileid, sizeof(v->fileid));
+        read(fdidx, &v->check, sizeof(v->check));
+        read(fdidx, &v->size, sizeof(v->size));
+        read(fdidx, &v->mtime, sizeof(v->mtime));
+        read(fdidx, &v->tag, VALIDATOR_LEN);
+        v->tag[VALIDATOR_LEN - 1] = 0;
+        v->next = validators;
+        validators = v;
+    }
     return 0;
 }
 
@@ -191,21 +656,51 @@ ssize_t get_cached(struct_url *url, off_t start, size_t rsize) {
 #ifdef USE_THREAD
     pthread_mutex_lock(&cache_lock);
 #endif
-    p = idxhead;
+    /* without a validator of its own the blocks with the fileid belong
+     * to another file */
+    p = validator_find(url) ? idxhead : NULL;
 
     while (p) {
-        if ( (p->start <= start) && ((p->start + (off_t)p->size-1) >= start+(off_t)rsize-1) ) {
-
-            lseek(fdcache, p->cstart, SEEK_SET); // set to start of block to read header
-            read(fdcache, md5[0], CRCLEN);
+        if ( (p->fileid == url->fileid) && !p->stale && (p->start <= start) && ((p->start + (off_t)p->size-1) >= start+(off_t)rsize-1) ) {
+
+            /* the md5 before and after the block and the data, a
+             * compressed block is read whole */
+            struct iovec iov[3] = {
+                { md5[0], CRCLEN },
+                { url->req_buf, rsize },
+                { md5[1], CRCLEN },
+            };
+            struct_cache_io io[3] = {
+                { fdcache, 0, &iov[0], 1, p->cstart, 0 },
+                { fdcache, 0, &iov[1], 1, p->cstart + (start - p->start) + CRCLEN, 0 },
+                { fdcache, 0, &iov[2], 1, p->cstart + (off_t)p->csize + CRCLEN, 0 },
+            };
+            if (p->codec != CODEC_NONE) {
+                if (p->csize + p->size > codec_buf_size) {
+                    char * grown = realloc(codec_buf, p->csize + p->size);
+                    if (!grown)
+                        break; /* a miss, the block is read from the server */
+                    codec_buf = grown;
+                    codec_buf_size = p->csize + p->size;
+                }
+                iov[1].iov_base = codec_buf;
+                iov[1].iov_len = p->csize;
+                io[1].off = p->cstart + CRCLEN;
+            }
+            if (cache_io(io, 3, 0) != 3)
+                md5[0][0] = 0;
+            bytes = io[1].res;
             md5[0][32] = 0;
-
-            lseek(fdcache, p->cstart + (start - p->start)+CRCLEN ,SEEK_SET);
-            bytes = (ssize_t)read(fdcache, url->req_buf, rsize);
-
-            lseek(fdcache, p->cstart + (off_t)p->size + CRCLEN, SEEK_SET); // set to start of block to read header
-            read(fdcache, md5[1], CRCLEN);
             md5[1][32] = 0;
+            if (p->codec != CODEC_NONE && md5[0][0]) {
+                /* a whole block goes straight into the reply buffer */
+                char * dst = rsize == p->size ? url->req_buf : codec_buf + p->csize;
+                if (codec_decompress(p->codec, codec_buf, p->csize, dst, p->size))
+                    md5[0][0] = 0;
+                else if (dst != url->req_buf)
+                    memcpy(url->req_buf, dst + (start - p->start), rsize);
+                bytes = (ssize_t)rsize;
+            }
 
 
             if (strcmp(p->md5, md5[0]) || strcmp(p->md5, md5[1])){ // Everything is bad. cache corrupted. reset cache
@@ -246,9 +741,229 @@ ssize_t get_cached(struct_url *url, off_t start, size_t rsize) {
     return bytes;
 }
 
+/* Size of an index entry in the file */
+#define IDX_ENTRY (sizeof(uint64_t) + sizeof(off_t) + sizeof(size_t) + sizeof(off_t) \
+        + sizeof(size_t) + sizeof(int) + CRCLEN)
+#define IDX_VALIDATOR (2 * sizeof(uint64_t) + sizeof(off_t) + sizeof(time_t) + VALIDATOR_LEN)
+
+static char * idx_buf = NULL;
+static size_t idx_buf_size = 0;
+
+/* Put the index together in idx_buf, returns its length. cache_lock held */
+static size_t index_build(void)
+{
+    static const int idx_header[2] = { IDX_MAGIC, IDX_VERSION };
+    struct_range *p;
+    struct_validator *v;
+    int c, last, n;
+    char * e;
+    size_t len;
+
+    for (p = idxhead, c = 0; p; p = p->next)
+        c++;
+    for (v = validators, n = 0; v; v = v->next)
+        n++;
+    len = sizeof(idx_header) + sizeof(c) + sizeof(last) + (size_t)c * IDX_ENTRY
+        + sizeof(n) + (size_t)n * IDX_VALIDATOR;
+    if (len > idx_buf_size) {
+        idx_buf_size = len * 2;
+        idx_buf = realloc(idx_buf, idx_buf_size);
+    }
+    e = idx_buf + sizeof(idx_header) + sizeof(c) + sizeof(last);
+    for (p = idxhead, c = 0, last = 0; p; p = p->next, c++) {
+        /* stale blocks are not kept over a restart */
+        off_t start = p->stale ? 0 : p->start;
+        size_t size = p->stale ? 0 : p->size;
+        if (p == lastidx) last=c;
+        memcpy(e, &p->fileid, sizeof(p->fileid)); e += sizeof(p->fileid);
+        memcpy(e, &start, sizeof(start)); e += sizeof(start);
+        memcpy(e, &size, sizeof(size)); e += sizeof(size);
+        memcpy(e, &p->cstart, sizeof(p->cstart)); e += sizeof(p->cstart);
+        memcpy(e, &p->csize, sizeof(p->csize)); e += sizeof(p->csize);
+        memcpy(e, &p->codec, sizeof(p->codec)); e += sizeof(p->codec);
+        memcpy(e, &p->md5, CRCLEN); e += CRCLEN;
+    }
+    memcpy(e, &n, sizeof(n)); e += sizeof(n);
+    for (v = validators; v; v = v->next) {
+        memcpy(e, &v->fileid, sizeof(v->fileid)); e += sizeof(v->fileid);
+        memcpy(e, &v->check, sizeof(v->check)); e += sizeof(v->check);
+        memcpy(e, &v->size, sizeof(v->size)); e += sizeof(v->size);
+        memcpy(e, &v->mtime, sizeof(v->mtime)); e += sizeof(v->mtime);
+        memcpy(e, &v->tag, VALIDATOR_LEN); e += VALIDATOR_LEN;
+    }
+    memcpy(idx_buf, &idx_header, sizeof(idx_header));
+    memcpy(idx_buf + sizeof(idx_header), &c, sizeof(c));
+    memcpy(idx_buf + sizeof(idx_header) + sizeof(c), &last, sizeof(last));
+    return len;
+}
+
+/* Write the index alone, cache_lock held */
+static void index_write(void)
+{
+    struct iovec iov;
+    struct_cache_io io = { fdidx, 1, &iov, 1, 0, 0 };
+
+    if (fdidx <= 0)
+        return;
+    /* index_build() may move idx_buf */
+    iov.iov_len = index_build();
+    iov.iov_base = idx_buf;
+    if (cache_io(&io, 1, 0) != 1)
+        log_msg(L_WARN, "Cache index write failed\n");
+}
+
+/* The validator of the file of url, NULL if it has none. cache_lock held */
+static struct_validator * validator_find(struct_url * url)
+{
+    struct_validator * v;
+    for (v = validators; v && v->fileid != url->fileid; v = v->next);
+    return v && v->check == url->filecheck ? v : NULL;
+}
+
+/*
+ * Blocks of the file are only made unusable, the space is reused in turn.
+ * With -m they are kept as stale for delta_reuse() to look at first.
+ */
+static void cache_drop_file(uint64_t fileid)
+{
+    struct_range * p;
+    for (p = idxhead; p; p = p->next)
+        if (p->fileid == fileid) {
+            if (digest_suffix && p->size) {
+                p->stale = 1;
+                continue;
+            }
+            p->start = 0;
+            p->size = 0;
+        }
+}
+
+/*
+ * The validator of the file of url, created when missing. One of another
+ * file with the same fileid is taken over and the blocks of that file
+ * are dropped, two such files only take turns in the cache.
+ * cache_lock held
+ */
+static struct_validator * validator_claim(struct_url * url)
+{
+    struct_validator * v;
+    for (v = validators; v && v->fileid != url->fileid; v = v->next);
+    if (!v) {
+        v = calloc(1, sizeof(struct_validator));
+        v->fileid = url->fileid;
+        v->check = url->filecheck;
+        v->size = -1;
+        v->next = validators;
+        validators = v;
+    } else if (v->check != url->filecheck) {
+        log_msg(L_INFO, "%s: %s shares its cache id with another file, dropping the blocks of that one.\n",
+                url->tname, url->name ? url->name : url->path);
+        cache_drop_file(url->fileid);
+        v->check = url->filecheck;
+        v->tag[0] = 0;
+        v->size = -1;
+        v->mtime = 0;
+    }
+    return v;
+}
+
+/*
+ * The validator of a file with its size and mtime. Returns 0 when the
+ * file has none, the pointers may be NULL.
+ */
+static int validator_get(struct_url * url, char * tag, off_t * size, time_t * mtime)
+{
+    struct_validator * v;
+    int res = 0;
+
+#ifdef USE_THREAD
+    pthread_mutex_lock(&cache_lock);
+#endif
+    if ((v = validator_find(url)) && v->tag[0]) {
+        if (tag) strcpy(tag, v->tag);
+        if (size) *size = v->size;
+        if (mtime) *mtime = v->mtime;
+        res = 1;
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&cache_lock);
+#endif
+    return res;
+}
+
+/*
+ * Compare the validator of a reply with the one known for the file. When
+ * it differs the cached blocks of the file are dropped and 1 returned.
+ * A HEAD also gives the size and mtime to answer a 304 with.
+ */
+static int validator_check(struct_url * url, int head)
+{
+    struct_validator * v;
+    int changed = 0, write = 0;
+
+    if (!url->validator[0])
+        return 0;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&cache_lock);
+#endif
+    v = validator_claim(url);
+    if (strcmp(v->tag, url->validator)) {
+        if (v->tag[0]) {
+            log_msg(L_INFO, "%s: %s changed on the server, dropping its cached blocks.\n",
+                    url->tname, url->name ? url->name : url->path);
+            cache_drop_file(url->fileid);
+            changed = 1;
+        }
+        strcpy(v->tag, url->validator);
+        write = 1;
+    }
+    if (head && (changed || v->size != url->file_size || v->mtime != url->last_modified)) {
+        v->size = url->file_size;
+        v->mtime = url->last_modified;
+        write = 1;
+    }
+    if (write)
+        index_write();
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&cache_lock);
+#endif
+    return changed;
+}
+
+/* The server did not accept the validator, forget it with the blocks */
+static void validator_drop(struct_url * url)
+{
+    struct_validator * v;
+
+#ifdef USE_THREAD
+    pthread_mutex_lock(&cache_lock);
+#endif
+    if ((v = validator_find(url))) {
+        cache_drop_file(url->fileid);
+        v->tag[0] = 0;
+        v->size = -1;
+        index_write();
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&cache_lock);
+#endif
+}
+
 ssize_t update_cache(struct_url *url, off_t start, size_t rsize, char *md5) {
     struct_range *p, *t;
-    int c, last;
+    size_t len, csize = rsize;
+    char * packed = NULL;
+    int codec = CODEC_NONE;
+
+    /* compressed before the lock is taken */
+    if (cache_codec != CODEC_NONE) {
+        size_t room = codec_bound(cache_codec, rsize);
+        if ((packed = malloc(room))
+                && (len = codec_compress(cache_codec, url->req_buf, rsize, packed, room))) {
+            csize = len;
+            codec = cache_codec;
+        }
+    }
 #ifdef USE_THREAD
     pthread_mutex_lock(&cache_lock);
 #endif
@@ -256,34 +971,39 @@ ssize_t update_cache(struct_url *url, off_t start, size_t rsize, char *md5) {
         lastidx = idxhead = malloc(sizeof(struct_range));
         lastidx->next = 0;
         lastidx->cstart = 0;
-    } else if (lastidx->cstart + (off_t)lastidx->size + CRCLEN*2 > cacheMaxSize) {
+    } else if (lastidx->cstart + (off_t)lastidx->csize + CRCLEN*2 > cacheMaxSize) {
         lastidx = idxhead; // reached max file size. start from brginning
     } else if (lastidx->next == NULL) { // we may add one more block into cache
         lastidx->next = malloc(sizeof(struct_range));
-        lastidx->next->cstart = lastidx->cstart + (off_t)lastidx->size + CRCLEN*2;
+        lastidx->next->cstart = lastidx->cstart + (off_t)lastidx->csize + CRCLEN*2;
         lastidx = lastidx->next;
         lastidx->next = 0;
     } else { // we are in a middle of cache file.
-        if (lastidx->next->cstart > lastidx->cstart + (off_t)lastidx->size + CRCLEN*2 + (off_t)rsize + CRCLEN*2) { // there is enough space till oldest block (large block was deleted earlier
+        if (lastidx->next->cstart > lastidx->cstart + (off_t)lastidx->csize + CRCLEN*2 + (off_t)csize + CRCLEN*2) { // there is enough space till oldest block (large block was deleted earlier
             p = malloc(sizeof(struct_range));
             p->next = lastidx->next;
-            p->cstart = lastidx->cstart + (off_t)lastidx->size + CRCLEN*2;
+            p->cstart = lastidx->cstart + (off_t)lastidx->csize + CRCLEN*2;
             lastidx->next = p;
             lastidx = p;
         } else {
-            lastidx->next->cstart = lastidx->cstart + (off_t)lastidx->size + CRCLEN*2;
+            lastidx->next->cstart = lastidx->cstart + (off_t)lastidx->csize + CRCLEN*2;
             lastidx = lastidx->next;
         }
     }
+    validator_claim(url);
+    lastidx->fileid = url->fileid;
     lastidx->start = start;
     lastidx->size = rsize;
+    lastidx->csize = csize;
+    lastidx->codec = codec;
+    lastidx->stale = 0;
     strncpy(lastidx->md5, md5, 32);
     lastidx->md5[32]=0;
 
     // now we need remove indexes, which blocks will be overwritten
     p = lastidx->next;
     while (p) {
-        if (p->cstart < lastidx->cstart + (off_t)lastidx->size + CRCLEN*2) {
+        if (p->cstart < lastidx->cstart + (off_t)lastidx->csize + CRCLEN*2) {
             t = p;
             p = p->next;
             lastidx->next = p;
@@ -291,73 +1011,684 @@ ssize_t update_cache(struct_url *url, off_t start, size_t rsize, char *md5) {
         } else p=0;
     }
 
-    lseek(fdcache, lastidx->cstart, SEEK_SET);
-    write(fdcache, md5, CRCLEN);
-    write(fdcache, url->req_buf, rsize);
-    write(fdcache, md5, CRCLEN);
+    // the index is put together in memory and written at once
+    len = index_build();
 
-
-    lseek(fdidx, sizeof(c)+sizeof(last), SEEK_SET);
-    p = idxhead; c = 0, last = 0;;
-    do {
-        if (p == lastidx) last=c;
-        write(fdidx, &p->start, sizeof(p->start));
-        write(fdidx, &p->size, sizeof(p->size));
-        write(fdidx, &p->cstart, sizeof(p->cstart));
-        write(fdidx, &p->md5, CRCLEN);
-        c++;
-    } while ( (p = p->next) );
-    lseek(fdidx, 0, SEEK_SET);
-    write(fdidx, &c, sizeof(c));
-    write(fdidx, &last, sizeof(last));
+    {
+        struct iovec iov[4] = {
+            { md5, CRCLEN },
+            { codec != CODEC_NONE ? packed : url->req_buf, csize },
+            { md5, CRCLEN },
+            { idx_buf, len },
+        };
+        struct_cache_io io[2] = {
+            { fdcache, 1, &iov[0], 3, lastidx->cstart, 0 },
+            { fdidx, 1, &iov[3], 1, 0, 0 },
+        };
+        if (cache_io(io, 2, 1) != 2)
+            log_msg(L_WARN, "Cache write failed\n");
+    }
 
 #ifdef USE_THREAD
     pthread_mutex_unlock(&cache_lock);
 #endif
+    free(packed);
     return 0;
 }
 
 // ========== END CACHE ============
 
-
-static struct_url main_url;
-static char* argv0;
-
-static off_t get_stat(struct_url*, struct stat * stbuf);
-static ssize_t get_data(struct_url*, off_t start, size_t rsize);
-static int open_client_socket(struct_url *url);
-static int close_client_socket(struct_url *url);
-static int close_client_force(struct_url *url);
-static struct_url * thread_setup(void);
-static void destroy_url_copy(void *);
-
-/* Protocol symbols. */
-#define PROTO_HTTP 0
-#ifdef USE_SSL
-#define PROTO_HTTPS 1
+// ========== BUFFER POOL ============
+/*
+ * Read buffers are taken from a pool shared by all threads for the
+ * duration of one request. Buffers are kept in power of two size classes
+ * and reused, the memory held by the pool is capped by poolMaxSize.
+ * Requests over the cap wait for a buffer to be returned.
+ */
+#define POOLMAXSIZE (64*1024*1024)
+#define POOL_MIN_SHIFT 12 /* 4k */
+#define POOL_CLASSES 20 /* up to 2G */
+#define HUGEPAGE_SIZE (2*1024*1024)
+
+typedef struct pool_buf struct_pool_buf;
+typedef struct pool_buf {
+    struct_pool_buf *next;
+    size_t size; /* usable size */
+    size_t mapped; /* mmap()ed length, 0 if malloc()ed */
+    char data[] __attribute__((aligned(64)));
+} struct_pool_buf;
+
+struct_pool_buf *pool_free[POOL_CLASSES];
+off_t poolMaxSize = POOLMAXSIZE;
+off_t pool_total = 0; // memory held by the pool, used and free
+int pool_hugepages = 0;
+#ifdef USE_THREAD
+pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
 #endif
 
-#ifdef USE_AUTH
+static int pool_class(size_t size) {
+    int c = 0;
+    while (((size_t)1 << (c + POOL_MIN_SHIFT)) < size) c++;
+    return c;
+}
 
-static char b64_encode_table[64] = {
-    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',  /* 0-7 */
-    'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',  /* 8-15 */
-    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',  /* 16-23 */
-    'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',  /* 24-31 */
-    'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',  /* 32-39 */
-    'o', 'p', 'q', 'r', 's', 't', 'u', 'v',  /* 40-47 */
-    'w', 'x', 'y', 'z', '0', '1', '2', '3',  /* 48-55 */
-    '4', '5', '6', '7', '8', '9', '+', '/'   /* 56-63 */
-};
+static void pool_release_mem(struct_pool_buf *b) {
+    if (b->mapped)
+        munmap(b, b->mapped);
+    else
+        free(b);
+}
 
-//===========================================
-// MD5 declarations
+/* Drop one idle buffer to make room under the cap, largest first */
+static int pool_shrink(void) {
+    int c;
+    for (c = POOL_CLASSES - 1; c >= 0; c--) {
+        struct_pool_buf *b = pool_free[c];
+        if (b) {
+            pool_free[c] = b->next;
+            pool_total -= (off_t)b->size;
+            pool_release_mem(b);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-/* Any 32-bit or wider unsigned integer data type will do */
-typedef unsigned int MD5_u32plus;
+char * buf_get(size_t size, size_t *bufsize) {
+    int c = pool_class(size);
+    size_t csize = (size_t)1 << (c + POOL_MIN_SHIFT);
+    size_t len = csize + offsetof(struct_pool_buf, data);
+    struct_pool_buf *b;
 
-typedef struct {
-    MD5_u32plus lo, hi;
+    assert(c < POOL_CLASSES);
+#ifdef USE_THREAD
+    pthread_mutex_lock(&pool_lock);
+#endif
+    while (!(b = pool_free[c]) && pool_total > 0
+            && pool_total + (off_t)csize > poolMaxSize) {
+        if (pool_shrink()) continue;
+#ifdef USE_THREAD
+        pthread_cond_wait(&pool_cond, &pool_lock);
+#else
+        break;
+#endif
+    }
+    if (b)
+        pool_free[c] = b->next;
+    else
+        pool_total += (off_t)csize;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&pool_lock);
+#endif
+    if (!b) {
+        void *m = MAP_FAILED;
+#ifdef MAP_ANONYMOUS
+        if (pool_hugepages && len >= HUGEPAGE_SIZE) {
+            len = (len + HUGEPAGE_SIZE - 1) & ~((size_t)HUGEPAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+            m = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+            if (m == MAP_FAILED) { /* no reserved huge pages, try transparent ones */
+                m = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+#ifdef MADV_HUGEPAGE
+                if (m != MAP_FAILED) madvise(m, len, MADV_HUGEPAGE);
+#endif
+            }
+        }
+#endif
+        if (m != MAP_FAILED) {
+            b = m;
+            b->mapped = len;
+        } else if ((b = malloc(len))) {
+            b->mapped = 0;
+        } else {
+#ifdef USE_THREAD
+            pthread_mutex_lock(&pool_lock);
+#endif
+            pool_total -= (off_t)csize;
+#ifdef USE_THREAD
+            pthread_cond_broadcast(&pool_cond);
+            pthread_mutex_unlock(&pool_lock);
+#endif
+            errno = ENOMEM;
+            return NULL;
+        }
+        b->size = csize;
+    }
+    *bufsize = b->size;
+    return b->data;
+}
+
+void buf_put(char *buf) {
+    struct_pool_buf *b;
+    int c;
+    if (!buf) return;
+    b = (struct_pool_buf *)(buf - offsetof(struct_pool_buf, data));
+    c = pool_class(b->size);
+#ifdef USE_THREAD
+    pthread_mutex_lock(&pool_lock);
+#endif
+    b->next = pool_free[c];
+    pool_free[c] = b;
+#ifdef USE_THREAD
+    /* waiters may want other size classes, each one checks for itself */
+    pthread_cond_broadcast(&pool_cond);
+    pthread_mutex_unlock(&pool_lock);
+#endif
+}
+
+// ========== END BUFFER POOL ============
+
+// ========== STATISTICS ============
+/*
+ * Every thread counts into its own block so counting needs no locking or
+ * locked instructions, the blocks are only summed up when the statistics
+ * are read. A block has a single writer, so a counter is updated with a
+ * relaxed atomic load and store: a plain move on common hardware, but a
+ * reader in another thread never sees a torn value.
+ * Blocks of ended threads are added to stats_retired.
+ * Latency histograms have power of two buckets in microseconds.
+ */
+#define STATS_NAME ".httpfs-stats"
+#define HIST_BUCKETS 25
+
+enum stat_counter {
+    ST_CACHE_HIT,
+    ST_CACHE_ERRORS,
+    ST_CACHE_MISS,
+    ST_BYTES_CACHE,
+    ST_BYTES_NET,
+    ST_REQUESTS,
+    ST_CONNECTS,
+    ST_KEEPALIVE_REUSE,
+    ST_REDIRECTS,
+    ST_MD5_RETRIES,
+    ST_RESETS,
+    ST_PREFETCH_HITS,
+    ST_TLS_RESUMED,
+    ST_DNS_LOOKUPS,
+    ST_REDIRECTS_CACHED,
+    ST_HEDGES,
+    ST_HEDGE_WINS,
+    ST_RESUMES,
+    ST_VALIDATOR_CHANGES,
+    ST_DELTA_REUSED,
+    ST_COUNTERS
+};
+
+static const char * stat_counter_names[ST_COUNTERS] = {
+    "cache_hits",
+    "cache_read_errors",
+    "cache_misses",
+    "bytes_from_cache",
+    "bytes_from_network",
+    "http_requests",
+    "connects",
+    "keepalive_reuses",
+    "redirects",
+    "md5_retries",
+    "resets",
+    "prefetch_hits",
+    "tls_resumed",
+    "dns_lookups",
+    "redirects_cached",
+    "hedged_requests",
+    "hedge_wins",
+    "resumed_reads",
+    "remote_changes",
+    "delta_reused_blocks",
+};
+
+enum stat_hist {
+    HI_GET_DATA,
+    HI_EXCHANGE,
+    HI_CACHE_READ,
+    HI_CACHE_WRITE,
+    ST_HISTS
+};
+
+static const char * stat_hist_names[ST_HISTS] = {
+    "get_data",
+    "exchange",
+    "cache_read",
+    "cache_write",
+};
+
+struct stats {
+    uint64_t counter[ST_COUNTERS];
+    uint64_t hist[ST_HISTS][HIST_BUCKETS];
+    uint64_t hist_sum[ST_HISTS]; /* microseconds */
+    struct_stats * next;
+};
+
+static struct_stats stats_main, stats_retired;
+static struct_stats * stats_list = &stats_main;
+#ifdef USE_THREAD
+pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define STAT_LOAD(v) __atomic_load_n(&(v), __ATOMIC_RELAXED)
+#define STAT_INC(v, n) __atomic_store_n(&(v), STAT_LOAD(v) + (uint64_t)(n), __ATOMIC_RELAXED)
+#define STAT_ADD(url, c, n) STAT_INC((url)->stats->counter[c], n)
+
+static uint64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+static void stat_time(struct_url *url, enum stat_hist h, uint64_t start) {
+    uint64_t t = now_us() - start;
+    int b = 0;
+    while (b < HIST_BUCKETS - 1 && (t >> b)) b++;
+    STAT_INC(url->stats->hist[h][b], 1);
+    STAT_INC(url->stats->hist_sum[h], t);
+}
+
+static struct_stats * stats_new(void) {
+    struct_stats *st = calloc(1, sizeof(struct_stats));
+#ifdef USE_THREAD
+    pthread_mutex_lock(&stats_lock);
+#endif
+    st->next = stats_list;
+    stats_list = st;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&stats_lock);
+#endif
+    return st;
+}
+
+static void stats_sum(struct_stats *sum, const struct_stats *st) {
+    int i, j;
+    for (i = 0; i < ST_COUNTERS; i++)
+        sum->counter[i] += STAT_LOAD(st->counter[i]);
+    for (i = 0; i < ST_HISTS; i++) {
+        for (j = 0; j < HIST_BUCKETS; j++)
+            sum->hist[i][j] += STAT_LOAD(st->hist[i][j]);
+        sum->hist_sum[i] += STAT_LOAD(st->hist_sum[i]);
+    }
+}
+
+static void stats_retire(struct_stats *st) {
+    struct_stats **p;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&stats_lock);
+#endif
+    for (p = &stats_list; *p; p = &(*p)->next)
+        if (*p == st) {
+            *p = st->next;
+            break;
+        }
+    stats_sum(&stats_retired, st);
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&stats_lock);
+#endif
+    free(st);
+}
+
+/* Text served as the statistics file */
+static char * stats_content(size_t *length) {
+    struct_stats sum, *st;
+    size_t size = 8192, len = 0;
+    char *buf = malloc(size);
+    int i, j;
+
+    memset(&sum, 0, sizeof(sum));
+#ifdef USE_THREAD
+    pthread_mutex_lock(&stats_lock);
+#endif
+    stats_sum(&sum, &stats_retired);
+    for (st = stats_list; st; st = st->next)
+        stats_sum(&sum, st);
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&stats_lock);
+#endif
+    for (i = 0; i < ST_COUNTERS; i++)
+        len += (size_t)snprintf(buf + len, size - len, "%s %" PRIu64 "\n",
+                stat_counter_names[i], sum.counter[i]);
+    for (i = 0; i < ST_HISTS; i++) {
+        uint64_t n = 0;
+        for (j = 0; j < HIST_BUCKETS; j++)
+            n += sum.hist[i][j];
+        len += (size_t)snprintf(buf + len, size - len, "%s_us count %" PRIu64 " avg %" PRIu64 "\n",
+                stat_hist_names[i], n, n ? sum.hist_sum[i] / n : 0);
+        for (j = 0; j < HIST_BUCKETS; j++)
+            if (sum.hist[i][j])
+                len += (size_t)snprintf(buf + len, size - len, "%s_us %s%llu %" PRIu64 "\n",
+                        stat_hist_names[i], j == HIST_BUCKETS - 1 ? ">=" : "<",
+                        j == HIST_BUCKETS - 1 ? 1ULL << (j - 1) : 1ULL << j, sum.hist[i][j]);
+    }
+    *length = len;
+    return buf;
+}
+
+// ========== END STATISTICS ============
+
+// ========== TRACE ============
+/*
+ * With -X n the phases of the last n requests are kept in a ring shared by
+ * all threads. A slot is taken with an atomic increment, the ring is never
+ * locked. The ring is written out as Chrome trace JSON (chrome://tracing,
+ * Perfetto) when the hidden .httpfs-trace file is read or to a new file
+ * named after TRACE_FILE on SIGUSR1. The signal handler only sets a flag,
+ * the file is written by the log thread, so also while all other threads
+ * hang in the network, or by the next traced request without threads.
+ * The file is created with mkstemp(), never over an existing one.
+ */
+#define TRACE_NAME ".httpfs-trace"
+#define TRACE_FILE "/tmp/httpfs2-trace.XXXXXX"
+#define TRACE_MAX 100000 /* -X limit, the JSON takes up to TRACE_EVENT_MAX per event */
+
+enum trace_phase {
+    TR_NONE, /* slot being written */
+    TR_GET_DATA,
+    TR_DNS,
+    TR_CONNECT,
+    TR_TLS,
+    TR_TTFB,
+    TR_TRANSFER,
+    TR_HASH, /* summed over the transfer, the MD5 is updated as data arrives */
+    TR_CACHE_READ,
+    TR_CACHE_WRITE,
+    TR_PHASES
+};
+
+static const char * trace_names[TR_PHASES] = {
+    "", "get_data", "dns", "connect", "tls", "ttfb", "transfer", "hash",
+    "cache_read", "cache_write",
+};
+
+typedef struct {
+    volatile int phase;
+    unsigned long tid;
+    uint64_t ts, dur; /* microseconds */
+    fuse_ino_t ino;
+    off_t off;
+    size_t size;
+} struct_trace_event;
+
+static struct_trace_event * trace_ring = NULL;
+static unsigned long trace_size = 0;
+static unsigned long trace_next = 0;
+static volatile int trace_pending = 0;
+
+/* Start of a traced phase, 0 when tracing is off */
+static uint64_t trace_now(void) {
+    return trace_ring ? now_us() : 0;
+}
+
+static void trace(enum trace_phase phase, struct_url *url, uint64_t start,
+        uint64_t dur, off_t off, size_t size) {
+    struct_trace_event *e;
+    if (!trace_ring)
+        return;
+    if (trace_pending)
+        trace_poll();
+    if (!dur)
+        dur = now_us() - start;
+    e = &trace_ring[__sync_fetch_and_add(&trace_next, 1) % trace_size];
+    e->phase = TR_NONE;
+    __sync_synchronize();
+#ifdef USE_THREAD
+    e->tid = (unsigned long)pthread_self();
+#else
+    e->tid = 1;
+#endif
+    e->ts = start;
+    e->dur = dur;
+    e->ino = url->ino;
+    e->off = off;
+    e->size = size;
+    __sync_synchronize();
+    e->phase = phase;
+}
+
+static char * trace_num(char *p, uint64_t n) {
+    char tmp[20];
+    int i = 0;
+    do tmp[i++] = (char)('0' + n % 10); while (n /= 10);
+    while (i) *p++ = tmp[--i];
+    return p;
+}
+
+static char * trace_str(char *p, const char *str) {
+    while (*str) *p++ = *str++;
+    return p;
+}
+
+/* Format the i-th oldest event, return its length, 0 for empty slots */
+static size_t trace_event_json(char *buf, unsigned long i, int first) {
+    struct_trace_event e = trace_ring[i % trace_size];
+    char *p = buf;
+    if (e.phase <= TR_NONE || e.phase >= TR_PHASES)
+        return 0;
+    p = trace_str(p, first ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+    p = trace_str(p, trace_names[e.phase]);
+    p = trace_str(p, "\",\"ph\":\"X\",\"pid\":1,\"tid\":");
+    p = trace_num(p, e.tid);
+    p = trace_str(p, ",\"ts\":");
+    p = trace_num(p, e.ts);
+    p = trace_str(p, ",\"dur\":");
+    p = trace_num(p, e.dur);
+    p = trace_str(p, ",\"args\":{\"ino\":");
+    p = trace_num(p, e.ino);
+    if (e.phase == TR_GET_DATA || e.phase == TR_CACHE_READ || e.phase == TR_CACHE_WRITE) {
+        p = trace_str(p, ",\"offset\":");
+        p = trace_num(p, (uint64_t)e.off);
+        p = trace_str(p, ",\"size\":");
+        p = trace_num(p, e.size);
+    }
+    p = trace_str(p, "}}");
+    return (size_t)(p - buf);
+}
+
+#define TRACE_EVENT_MAX 256
+#define TRACE_HEAD "{\"traceEvents\":["
+#define TRACE_TAIL "\n]}\n"
+
+static char * trace_content(size_t *length) {
+    unsigned long i, last = trace_next;
+    size_t len = 0;
+    char *buf;
+    int first = 1;
+
+    if (!trace_ring) {
+        *length = 0;
+        return NULL;
+    }
+    buf = malloc(sizeof(TRACE_HEAD) + trace_size * TRACE_EVENT_MAX + sizeof(TRACE_TAIL));
+    if (!buf) {
+        *length = 0;
+        return NULL;
+    }
+    len = (size_t)(trace_str(buf, TRACE_HEAD) - buf);
+    for (i = last > trace_size ? last - trace_size : 0; i < last; i++) {
+        size_t l = trace_event_json(buf + len, i, first);
+        if (l)
+            first = 0;
+        len += l;
+    }
+    len = (size_t)(trace_str(buf + len, TRACE_TAIL) - buf);
+    *length = len;
+    return buf;
+}
+
+/* Write the ring to a new file when SIGUSR1 asked for it */
+static void trace_poll(void) {
+    char name[] = TRACE_FILE;
+    char *buf, *p;
+    size_t len;
+    ssize_t res = 0;
+    int fd;
+
+    if (!__sync_bool_compare_and_swap(&trace_pending, 1, 0))
+        return;
+    if ((fd = mkstemp(name)) < 0) {
+        log_msg(L_ERROR, "trace: %s: %s.\n", name, strerror(errno));
+        return;
+    }
+    if (!(buf = trace_content(&len))) {
+        log_msg(L_ERROR, "trace: %s: %s.\n", name, strerror(ENOMEM));
+        close(fd);
+        unlink(name);
+        return;
+    }
+    for (p = buf; len > 0 && (res = write(fd, p, len)) > 0; p += res)
+        len -= (size_t)res;
+    close(fd);
+    free(buf);
+    if (res < 0)
+        log_msg(L_ERROR, "trace: %s: %s.\n", name, strerror(errno));
+    else
+        log_msg(L_INFO, "trace: written to %s.\n", name);
+}
+
+static void trace_signal(int sig) {
+    (void) sig;
+    trace_pending = 1;
+#ifdef USE_THREAD
+    if (log_ring)
+        sem_post(&log_sem);
+#endif
+}
+
+// ========== END TRACE ============
+
+
+static struct_url main_url;
+static char* argv0;
+static struct fuse_chan *fuse_ch = 0; // set once mounted, used for cache invalidation
+
+/*
+ * Nodes of the mounted tree. The root directory is inode 1 and files[i]
+ * is inode i + 2. A file node has a url template, threads work on copies
+ * of it and share the remote state kept in the node. A directory with a
+ * location is listed from the server on first use and the listing is
+ * kept for dir_ttl seconds.
+ *
+ * Nodes are never freed so pointers to them stay valid. The tree grows
+ * while mounted so files, files_count and the children arrays change
+ * only under files_lock.
+ */
+#define DIR_TTL 60
+#define MAX_LISTING (16*1024*1024)
+
+typedef struct file struct_file;
+struct file {
+    fuse_ino_t ino;
+    fuse_ino_t parent;
+    char * name;
+    struct_url * url; /* NULL for directories and generated files */
+    char * (*content)(size_t * length); /* generates the data of a local file */
+    /* Remote file state as last seen by any thread. The kernel keeps
+     * cached pages across opens (keep_cache) so they must be dropped when
+     * the file on the server changes. */
+    time_t remote_mtime;
+    off_t remote_size;
+    int size_listed; /* size comes from the directory listing, no HEAD needed */
+    char * location; /* url of the directory listing */
+    time_t listed; /* when the listing was fetched, 0 = not yet */
+    struct_file ** children;
+    size_t children_count;
+    /* children dropped from the listing, reused when the name comes back
+     * so it keeps its inode */
+    struct_file ** gone;
+    size_t gone_count;
+    int listing; /* a thread fetches the listing, the others wait for it */
+    int list_errno; /* why the last fetch of the listing failed */
+    int probed; /* start of the file checked for a known format (-F) */
+};
+
+static struct_file root_node = { .ino = 1, .parent = 1, .name = "", .remote_size = -1 };
+static struct_file ** files = 0;
+static size_t files_count = 0;
+static long dir_ttl = DIR_TTL;
+static char * dir_manifest = NULL; /* list directories from this file instead of the autoindex */
+
+#define FILE_INO(i) ((fuse_ino_t)(i) + 2)
+#define INO_FILE(ino) ((size_t)(ino) - 2)
+#define NODE_IS_DIR(f) (!(f)->url && !(f)->content)
+
+/* Snapshot of a generated file taken at open, kept in fi->fh */
+typedef struct {
+    char * data;
+    size_t length;
+} struct_snapshot;
+
+/* Pipes of a thread for zero copy reads, see splice_data() */
+typedef struct {
+    int data[2];
+    int hash[2];
+    int open;
+} struct_pipes;
+
+static off_t get_stat(struct_url*, struct stat * stbuf);
+static off_t get_file_size(struct_file * f);
+static struct_file * node_get(fuse_ino_t ino);
+static struct_file * node_child(struct_file * dir, const char * name);
+static int dir_refresh(struct_file * dir);
+static void inval_add(fuse_ino_t ino);
+static ssize_t get_data(struct_url*, off_t start, size_t rsize);
+static int splice_data(fuse_req_t req, struct_url * url, off_t start, size_t rsize);
+static void splice_close(struct_pipes * p);
+static struct_pipes * thread_pipes(void);
+static int splice_reads = 0;
+#define DNS_TTL 300
+static long dns_ttl = DNS_TTL; /* seconds to keep resolved addresses */
+static long redirect_ttl = 0; /* seconds to keep temporary redirects, -L */
+static long hedge_ms = 0; /* least wait before a request is sent again, -e */
+static long adapt_floor_ms = 0; /* least adaptive receive timeout, -A */
+static void sched_enter(struct_url * url, size_t size);
+static void sched_leave(struct_url * url);
+static size_t prefetch_take(struct_url * url, off_t off, size_t size);
+static void prefetch_release(uint64_t fileid);
+static void profile_record(struct_url * url, off_t off, size_t size);
+static void format_probe(struct_file * f, const char * data, size_t len);
+#ifdef USE_THREAD
+static void iso_path_table(struct_file * f, const unsigned char * table, size_t size);
+#endif
+static void delta_reuse(struct_url * url);
+static int open_client_socket(struct_url *url);
+static int close_client_socket(struct_url *url);
+static int close_client_force(struct_url *url);
+static ssize_t read_client_socket(struct_url *url, void * buf, size_t len);
+static ssize_t write_client_socket(struct_url *url, const void * buf, size_t len);
+static void http_report(const char * reason, const char * method,
+        const char * buf, size_t len);
+static struct_url * thread_setup(void);
+static struct_url * url_setup(struct_file * f);
+static int adopt_keepalive_socket(struct_url *url);
+static void destroy_url_copy(void *);
+static void destroy_thread_urls(void *);
+
+/* Protocol symbols. */
+#define PROTO_HTTP 0
+#ifdef USE_SSL
+#define PROTO_HTTPS 1
+#endif
+
+#ifdef USE_AUTH
+
+static char b64_encode_table[64] = {
+    'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H',  /* 0-7 */
+    'I', 'J', 'K', 'L', 'M', 'N', 'O', 'P',  /* 8-15 */
+    'Q', 'R', 'S', 'T', 'U', 'V', 'W', 'X',  /* 16-23 */
+    'Y', 'Z', 'a', 'b', 'c', 'd', 'e', 'f',  /* 24-31 */
+    'g', 'h', 'i', 'j', 'k', 'l', 'm', 'n',  /* 32-39 */
+    'o', 'p', 'q', 'r', 's', 't', 'u', 'v',  /* 40-47 */
+    'w', 'x', 'y', 'z', '0', '1', '2', '3',  /* 48-55 */
+    '4', '5', '6', '7', '8', '9', '+', '/'   /* 56-63 */
+};
+
+//===========================================
+// MD5 declarations
+
+/* Any 32-bit or wider unsigned integer data type will do */
+typedef unsigned int MD5_u32plus;
+
+typedef struct {
+    MD5_u32plus lo, hi;
     MD5_u32plus a, b, c, d;
     unsigned char buffer[64];
     MD5_u32plus block[16];
@@ -482,27 +1813,39 @@ static char * b64_encode(unsigned const char* ptr, long len) {
 
 static int httpfs_stat(fuse_ino_t ino, struct stat *stbuf)
 {
-    stbuf->st_ino = ino;
-    switch (ino) {
-        case 1:
-            stbuf->st_mode = S_IFDIR | 0755;
-            stbuf->st_nlink = 2;
-            break;
-
-        case 2: {
-                    struct_url * url = thread_setup();
-                    fprintf(stderr, "%s: %s: stat()\n", argv0, url->tname); /*DEBUG*/
-                    stbuf->st_mode = S_IFREG | 0444;
-                    stbuf->st_nlink = 1;
-                    return (int) get_stat(url, stbuf);
-                }
-                break;
+    struct_file * f = node_get(ino);
+    struct_url * url;
+    int listed;
 
-        default:
-                errno = ENOENT;
-                return -1;
+    stbuf->st_ino = ino;
+    if (!f) {
+        errno = ENOENT;
+        return -1;
     }
-    return 0;
+    if (NODE_IS_DIR(f)) {
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        return 0;
+    }
+    stbuf->st_mode = S_IFREG | 0444;
+    stbuf->st_nlink = 1;
+    if (f->content) /* size is not known before open, read until EOF */
+        return 0;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&files_lock);
+#endif
+    if ((listed = f->size_listed)) {
+        stbuf->st_size = f->remote_size;
+        stbuf->st_mtime = f->remote_mtime;
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&files_lock);
+#endif
+    if (listed)
+        return 0;
+    url = url_setup(f);
+    log_msg(L_DEBUG, "%s: %s: stat(%s)\n", argv0, url->tname, f->name);
+    return (int) get_stat(url, stbuf);
 }
 
 static void httpfs_getattr(fuse_req_t req, fuse_ino_t ino,
@@ -526,10 +1869,17 @@ static void httpfs_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     e.attr_timeout = 1.0;
     e.entry_timeout = 1.0;
 
-    if (parent != 1 || strcmp(name, main_url.name) != 0){
-        e.ino = 0;
-    } else {
-        e.ino = 2;
+    struct_file * dir = node_get(parent), * f = NULL;
+    if (dir && NODE_IS_DIR(dir)) {
+        if (dir_refresh(dir) < 0) {
+            assert(errno);
+            fuse_reply_err(req, errno);
+            return;
+        }
+        f = node_child(dir, name);
+    }
+    e.ino = f ? f->ino : 0;
+    if (e.ino) {
         if(httpfs_stat(e.ino, &e.attr) < 0){
             assert(errno);
             fuse_reply_err(req, errno);
@@ -575,17 +1925,29 @@ static int reply_buf_limited(fuse_req_t req, const char *buf, size_t bufsize,
 static void httpfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
         off_t off, struct fuse_file_info *fi)
 {
+    struct_file * dir = node_get(ino);
+
     (void) fi;
 
-    if (ino != 1)
+    if (!dir || !NODE_IS_DIR(dir))
         fuse_reply_err(req, ENOTDIR);
+    else if (dir_refresh(dir) < 0)
+        fuse_reply_err(req, errno);
     else {
         struct dirbuf b;
+        size_t i;
 
         memset(&b, 0, sizeof(b));
-        dirbuf_add(req, &b, ".", 1);
-        dirbuf_add(req, &b, "..", 1);
-        dirbuf_add(req, &b, main_url.name, 2);
+        dirbuf_add(req, &b, ".", dir->ino);
+        dirbuf_add(req, &b, "..", dir->parent);
+#ifdef USE_THREAD
+        pthread_mutex_lock(&files_lock);
+#endif
+        for (i = 0; i < dir->children_count; i++)
+            dirbuf_add(req, &b, dir->children[i]->name, dir->children[i]->ino);
+#ifdef USE_THREAD
+        pthread_mutex_unlock(&files_lock);
+#endif
         reply_buf_limited(req, b.p, b.size, off, size);
         free(b.p);
     }
@@ -594,17 +1956,32 @@ static void httpfs_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
 static void httpfs_open(fuse_req_t req, fuse_ino_t ino,
         struct fuse_file_info *fi)
 {
-    if (ino != 2)
+    struct_file * f = node_get(ino);
+
+    if (!f)
+        fuse_reply_err(req, ENOENT);
+    else if (NODE_IS_DIR(f))
         fuse_reply_err(req, EISDIR);
     else if ((fi->flags & 3) != O_RDONLY)
         fuse_reply_err(req, EACCES);
-    else{
+    else if (f->content) {
+        /* generated files have no size in stat so bypass the page cache */
+        struct_snapshot * snap = malloc(sizeof(struct_snapshot));
+        snap->data = f->content(&snap->length);
+        fi->fh = (uint64_t)(uintptr_t)snap;
+        fi->direct_io = 1;
+        fuse_reply_open(req, fi);
+    } else{
         /* direct_io is supposed to allow partial reads. However, setting
          * the flag causes read length max at 4096 bytes which leads to
          * *many* requests, poor performance, and errors. Some resources
          * like TCP ports are recycled too fast for Linux to cope.
          */
         //fi->direct_io = 1;
+        /* Keep the page cache across opens. It is invalidated in
+         * check_remote_change() when the file on the server changes.
+         */
+        fi->keep_cache = 1;
         fuse_reply_open(req, fi);
     }
 }
@@ -612,12 +1989,26 @@ static void httpfs_open(fuse_req_t req, fuse_ino_t ino,
 static void httpfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
         off_t off, struct fuse_file_info *fi)
 {
-    (void) fi;
-
-    struct_url * url = thread_setup();
+    struct_file * f = node_get(ino);
+    struct_url * url;
     ssize_t res;
+    uint64_t t;
 
-    assert(ino == 2);
+    if (f && f->content) {
+        struct_snapshot * snap = (struct_snapshot *)(uintptr_t)fi->fh;
+        reply_buf_limited(req, snap->data, snap->length, off, size);
+        return;
+    }
+    assert(f && f->url);
+    url = url_setup(f);
+    if ((url->file_size = get_file_size(f)) < 0) {
+        struct stat st;
+        if (get_stat(url, &st) < 0) {
+            assert(errno);
+            fuse_reply_err(req, errno);
+            return;
+        }
+    }
 
     assert(url->file_size >= off);
 
@@ -630,33 +2021,100 @@ static void httpfs_read(fuse_req_t req, fuse_ino_t ino, size_t size,
         return;
     }
     /* since we have to return all stuff requested the buffer cannot be
-     * allocated in advance */
-    if(url->req_buf
-            && ( (url->req_buf_size < size )
-                || ( (url->req_buf_size > size )
-                    && (url->req_buf_size > MAX_REQUEST) ) ) ){
-        free(url->req_buf);
-        url->req_buf = 0;
-    }
-    if(! url->req_buf){
-        url->req_buf_size = size;
-        url->req_buf = malloc(size);
+     * allocated in advance, it is taken from the pool for this request */
+    url->req_buf = buf_get(size, &url->req_buf_size);
+    if (!url->req_buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
     }
 
-    if((res = get_data(url, off, size)) < 0){
+    t = now_us();
+    res = (ssize_t)prefetch_take(url, off, size);
+    /* the start of a file is read to memory for format_probe() */
+    if (!res && off && splice_reads) {
+        int spliced;
+        sched_enter(url, size);
+        spliced = splice_data(req, url, off, size);
+        sched_leave(url);
+        if (spliced) {
+            stat_time(url, HI_GET_DATA, t);
+            trace(TR_GET_DATA, url, t, 0, off, size);
+            profile_record(url, off, size);
+            buf_put(url->req_buf);
+            url->req_buf = 0;
+            return;
+        }
+    }
+    if (!res)
+        res = get_data(url, off, size);
+    stat_time(url, HI_GET_DATA, t);
+    trace(TR_GET_DATA, url, t, 0, off, size);
+    if(res < 0){
         assert(errno);
         fuse_reply_err(req, errno);
     }else{
+        profile_record(url, off, size);
         fuse_reply_buf(req, url->req_buf, (size_t)res);
+        if (off == 0)
+            format_probe(f, url->req_buf, (size_t)res);
+    }
+    buf_put(url->req_buf);
+    url->req_buf = 0;
+}
+
+static void httpfs_release(fuse_req_t req, fuse_ino_t ino,
+        struct fuse_file_info *fi)
+{
+    struct_file * f = node_get(ino);
+
+    if (f && f->content) {
+        struct_snapshot * snap = (struct_snapshot *)(uintptr_t)fi->fh;
+        free(snap->data);
+        free(snap);
     }
+    fuse_reply_err(req, 0);
+    if (f && f->url)
+        prefetch_release(f->url->fileid);
+}
+
+/*
+ * Negotiate the connection parameters with the kernel. Every kernel read
+ * request becomes an HTTP request so ask for reads as large as possible
+ * and let the kernel issue readahead asynchronously.
+ */
+
+static long max_readahead = 0; /* 0 = the maximum the kernel offers */
+static long max_read = 0; /* 0 = kernel default, passed as a mount option */
+
+static void httpfs_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+
+    if (max_readahead > 0 && (unsigned) max_readahead < conn->max_readahead)
+        conn->max_readahead = (unsigned) max_readahead;
+    conn->async_read = 1;
+    conn->want |= conn->capable & (FUSE_CAP_ASYNC_READ
+            | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE
+            | FUSE_CAP_SPLICE_READ);
+
+    log_msg(L_INFO, "%s: FUSE protocol %u.%u, max_readahead %u, max_write %u, max_background %u\n",
+            argv0, conn->proto_major, conn->proto_minor,
+            conn->max_readahead, conn->max_write, conn->max_background);
+    log_msg(L_INFO, "%s: async read: %s, splice read/write/move: %s/%s/%s\n",
+            argv0, (conn->want & FUSE_CAP_ASYNC_READ) ? "yes" : "no",
+            (conn->want & FUSE_CAP_SPLICE_READ) ? "yes" : "no",
+            (conn->want & FUSE_CAP_SPLICE_WRITE) ? "yes" : "no",
+            (conn->want & FUSE_CAP_SPLICE_MOVE) ? "yes" : "no");
 }
 
 static struct fuse_lowlevel_ops httpfs_oper = {
+    .init               = httpfs_init,
     .lookup             = httpfs_lookup,
     .getattr            = httpfs_getattr,
     .readdir            = httpfs_readdir,
     .open               = httpfs_open,
     .read               = httpfs_read,
+    .release            = httpfs_release,
 };
 
 /*
@@ -843,17 +2301,17 @@ verify_certificate_callback (gnutls_session_t session)
         return GNUTLS_E_CERTIFICATE_ERROR;
     }
     if (status & GNUTLS_CERT_INVALID)
-        fprintf(stderr, "The server certificate is NOT trusted.\n");
+        log_msg(L_ERROR, "The server certificate is NOT trusted.\n");
     if (status & GNUTLS_CERT_INSECURE_ALGORITHM)
-        fprintf(stderr, "The server certificate uses an insecure algorithm.\n");
+        log_msg(L_ERROR, "The server certificate uses an insecure algorithm.\n");
     if (status & GNUTLS_CERT_SIGNER_NOT_FOUND)
-        fprintf(stderr, "The server certificate hasn’t got a known issuer.\n");
+        log_msg(L_ERROR, "The server certificate hasn’t got a known issuer.\n");
     if (status & GNUTLS_CERT_REVOKED)
-        fprintf(stderr, "The server certificate has been revoked.\n");
+        log_msg(L_ERROR, "The server certificate has been revoked.\n");
     if (status & GNUTLS_CERT_EXPIRED)
-        fprintf(stderr, "The server certificate has expired\n");
+        log_msg(L_ERROR, "The server certificate has expired\n");
     if (status & GNUTLS_CERT_NOT_ACTIVATED)
-        fprintf(stderr, "The server certificate is not yet activated\n");
+        log_msg(L_ERROR, "The server certificate is not yet activated\n");
     /* Up to here the process is the same for X.509 certificates and
      * OpenPGP keys. From now on X.509 certificates are assumed. This can
      * be easily extended to work with openpgp keys as well.
@@ -868,7 +2326,7 @@ verify_certificate_callback (gnutls_session_t session)
     cert_list = gnutls_certificate_get_peers (session, &cert_list_size);
     if (cert_list == NULL)
     {
-        fprintf(stderr, "No server certificate was found!\n");
+        log_msg(L_ERROR, "No server certificate was found!\n");
         return GNUTLS_E_CERTIFICATE_ERROR;
     }
     /* Check the hostname matches the certificate. */
@@ -879,7 +2337,7 @@ verify_certificate_callback (gnutls_session_t session)
         return GNUTLS_E_CERTIFICATE_ERROR;
     }
     if (!(url->ssl_connected)) if (!gnutls_x509_crt_print (cert, GNUTLS_CRT_PRINT_FULL, &data)) {
-        fprintf(stderr, "%s", data.data);
+        log_msg(L_INFO, "%s", data.data);
         gnutls_free(data.data);
     }
     if (!hostname || !gnutls_x509_crt_check_hostname (cert, hostname))
@@ -889,7 +2347,7 @@ verify_certificate_callback (gnutls_session_t session)
             int i;
             size_t len = strlen(hostname);
             if (*(hostname+len-1) == '.') len--;
-            if (!(url->ssl_connected)) fprintf(stderr, "Server hostname verification failed. Trying to peek into the cert.\n");
+            if (!(url->ssl_connected)) log_msg(L_WARN, "Server hostname verification failed. Trying to peek into the cert.\n");
             for (i=0;;i++) {
                 char * dn = NULL;
                 size_t dn_size = 0;
@@ -905,7 +2363,7 @@ verify_certificate_callback (gnutls_session_t session)
                         if (len == dn_size)
                             match = ! strncmp(dn, hostname, len);
                         if (match) found = 1;
-                        if (!(url->ssl_connected)) fprintf(stderr, "Cert CN(%i): %s: %c\n", i, dn, match?'*':'X');
+                        if (!(url->ssl_connected)) log_msg(L_INFO, "Cert CN(%i): %s: %c\n", i, dn, match?'*':'X');
                     }}
                 else
                     ssl_error(dn_ret, url, "getting cert subject data");
@@ -915,7 +2373,7 @@ verify_certificate_callback (gnutls_session_t session)
             }
         }
         if(!found){
-            fprintf(stderr, "The server certificate’s owner does not match hostname ’%s’\n",
+            log_msg(L_ERROR, "The server certificate’s owner does not match hostname ’%s’\n",
                     hostname);
             return GNUTLS_E_CERTIFICATE_ERROR;
         }
@@ -934,7 +2392,7 @@ verify_certificate_callback (gnutls_session_t session)
 
 static void logfunc(int level, const char * str)
 {
-    fputs(str, stderr);
+    log_msg(L_INFO, "%s", str);
 }
 
 static void ssl_error_p(ssize_t error, struct_url * url, const char * where, const char * extra)
@@ -945,7 +2403,7 @@ static void ssl_error_p(ssize_t error, struct_url * url, const char * where, con
     else
         err_desc = gnutls_strerror((int)error);
 
-    fprintf(stderr, "%s: %s: %s: %s%zd %s.\n", argv0, url->tname, where, extra, error, err_desc);
+    log_msg(L_ERROR, "%s: %s: %s: %s%zd %s.\n", argv0, url->tname, where, extra, error, err_desc);
 }
 
 static void ssl_error(ssize_t error, struct_url * url, const char * where)
@@ -954,29 +2412,273 @@ static void ssl_error(ssize_t error, struct_url * url, const char * where)
     /* FIXME try to decode errors more meaningfully */
     errno = EIO;
 }
-#endif
-
-static void errno_report(const char * where)
-{
-    struct_url * url = thread_setup();
-    int e = errno;
-    fprintf(stderr, "%s: %s: %s: %d %s.\n", argv0, url->tname, where, errno, strerror(errno));
-    errno = e;
-}
-
-static char * url_encode(char * path) {
-    return strdup(path); /*FIXME encode*/
-}
 
 /*
- * functions for handling struct_url
+ * The certificate credentials are loaded once and shared by the
+ * connections of all threads. The session data of the last full
+ * handshake with each host is kept so that reconnects, including those
+ * after a redirect back to the same host, resume the session with an
+ * abbreviated handshake.
  */
+typedef struct ssl_session {
+    char * host;
+    int port;
+    gnutls_datum_t data;
+    struct ssl_session * next;
+} struct_ssl_session;
 
-static int init_url(struct_url* url)
-{
+static gnutls_certificate_credentials_t ssl_cred;
+static int ssl_initialized = 0;
+static struct_ssl_session * ssl_sessions = NULL;
+#ifdef USE_THREAD
+pthread_mutex_t ssl_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int ssl_init(struct_url * url)
+{
+    int r = 0;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&ssl_lock);
+#endif
+    if (!ssl_initialized) {
+        r = gnutls_global_init();
+        if (!r)
+            r = gnutls_certificate_allocate_credentials (&ssl_cred);
+        if (url->cafile) {
+            if (!r)
+                r = gnutls_certificate_set_x509_trust_file (ssl_cred, url->cafile, GNUTLS_X509_FMT_PEM);
+            if (r>0)
+                log_msg(L_INFO, "%s: SSL init: loaded %i CA certificate(s).\n", argv0, r);
+            if (r>0) r = 0;
+        }
+        if (!r)
+            gnutls_certificate_set_verify_function (ssl_cred, verify_certificate_callback);
+        if (!r)
+            gnutls_certificate_set_verify_flags (ssl_cred, GNUTLS_VERIFY_ALLOW_X509_V1_CA_CRT /* suggested */
+                    | url->md5 | url->md2 ); /* oprional for old cert compat */
+        if (!r) ssl_initialized = 1;
+        gnutls_global_set_log_level((int)url->ssl_log_level);
+        gnutls_global_set_log_function(&logfunc);
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&ssl_lock);
+#endif
+    return r;
+}
+
+static struct_ssl_session * ssl_session_find(const struct_url * url)
+{
+    struct_ssl_session * s;
+    for (s = ssl_sessions; s; s = s->next)
+        if (s->port == url->port && !strcmp(s->host, url->host))
+            return s;
+    return NULL;
+}
+
+/* Set the saved session of the host before the handshake */
+static void ssl_session_resume(struct_url * url)
+{
+    struct_ssl_session * s;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&ssl_lock);
+#endif
+    s = ssl_session_find(url);
+    if (s && s->data.size)
+        gnutls_session_set_data(url->ss, s->data.data, s->data.size);
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&ssl_lock);
+#endif
+}
+
+/*
+ * Save the session of a connection for the next handshake with the host.
+ * Called when the connection is closed since TLS 1.3 servers send the
+ * session ticket after the handshake.
+ */
+static void ssl_session_save(struct_url * url)
+{
+    struct_ssl_session * s;
+    gnutls_datum_t data = { NULL, 0 };
+
+    if (gnutls_session_get_data2(url->ss, &data) || !data.size) {
+        gnutls_free(data.data);
+        return;
+    }
+#ifdef USE_THREAD
+    pthread_mutex_lock(&ssl_lock);
+#endif
+    s = ssl_session_find(url);
+    if (!s) {
+        s = calloc(1, sizeof(struct_ssl_session));
+        s->host = strdup(url->host);
+        s->port = url->port;
+        s->next = ssl_sessions;
+        ssl_sessions = s;
+    }
+    gnutls_free(s->data.data);
+    s->data = data;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&ssl_lock);
+#endif
+}
+
+#ifdef USE_KTLS
+/*
+ * Kernel TLS (-K). After the handshake the receive keys are installed on
+ * the socket so the kernel decrypts the records and responses are read
+ * with plain reads like http. Requests are still sent through gnutls.
+ * Connections stay with gnutls when the kernel has no tls module or the
+ * cipher is not one the kernel supports. TLS 1.3 session tickets arrive
+ * after the handshake and are decrypted by the kernel, gnutls cannot take
+ * them from there, so with -K TLS 1.3 sessions are not resumed.
+ */
+static int use_ktls = 0;
+
+static void ktls_setup(struct_url * url)
+{
+    gnutls_protocol_t version = gnutls_protocol_get_version(url->ss);
+    gnutls_datum_t mac, iv, key;
+    unsigned char seq[8];
+    union {
+        struct tls12_crypto_info_aes_gcm_128 gcm128;
+        struct tls12_crypto_info_aes_gcm_256 gcm256;
+        struct tls12_crypto_info_chacha20_poly1305 chacha;
+    } info;
+    struct tls_crypto_info * ci = &info.gcm128.info;
+    size_t size;
+    int tls13 = version == GNUTLS_TLS1_3;
+
+    if (!use_ktls || (version != GNUTLS_TLS1_2 && !tls13)
+            || gnutls_record_check_pending(url->ss)
+            || gnutls_record_get_state(url->ss, 1, &mac, &iv, &key, seq))
+        return;
+    memset(&info, 0, sizeof(info));
+    ci->version = tls13 ? TLS_1_3_VERSION : TLS_1_2_VERSION;
+    /* TLS 1.2 GCM sends the explicit nonce, the record sequence number,
+     * with each record, TLS 1.3 derives the whole nonce from the iv */
+    switch (gnutls_cipher_get(url->ss)) {
+        case GNUTLS_CIPHER_AES_128_GCM:
+            if (key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE || iv.size < (tls13 ? 12 : 4))
+                return;
+            ci->cipher_type = TLS_CIPHER_AES_GCM_128;
+            memcpy(info.gcm128.key, key.data, key.size);
+            memcpy(info.gcm128.salt, iv.data, TLS_CIPHER_AES_GCM_128_SALT_SIZE);
+            memcpy(info.gcm128.iv, tls13 ? iv.data + 4 : seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+            memcpy(info.gcm128.rec_seq, seq, TLS_CIPHER_AES_GCM_128_REC_SEQ_SIZE);
+            size = sizeof(info.gcm128);
+            break;
+        case GNUTLS_CIPHER_AES_256_GCM:
+            if (key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE || iv.size < (tls13 ? 12 : 4))
+                return;
+            ci->cipher_type = TLS_CIPHER_AES_GCM_256;
+            memcpy(info.gcm256.key, key.data, key.size);
+            memcpy(info.gcm256.salt, iv.data, TLS_CIPHER_AES_GCM_256_SALT_SIZE);
+            memcpy(info.gcm256.iv, tls13 ? iv.data + 4 : seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+            memcpy(info.gcm256.rec_seq, seq, TLS_CIPHER_AES_GCM_256_REC_SEQ_SIZE);
+            size = sizeof(info.gcm256);
+            break;
+        case GNUTLS_CIPHER_CHACHA20_POLY1305:
+            if (key.size != TLS_CIPHER_CHACHA20_POLY1305_KEY_SIZE || iv.size < 12)
+                return;
+            ci->cipher_type = TLS_CIPHER_CHACHA20_POLY1305;
+            memcpy(info.chacha.key, key.data, key.size);
+            memcpy(info.chacha.iv, iv.data, TLS_CIPHER_CHACHA20_POLY1305_IV_SIZE);
+            memcpy(info.chacha.rec_seq, seq, TLS_CIPHER_CHACHA20_POLY1305_REC_SEQ_SIZE);
+            size = sizeof(info.chacha);
+            break;
+        default:
+            log_msg(L_DEBUG, "%s: %s: no kTLS for cipher %s.\n", argv0, url->tname,
+                    gnutls_cipher_get_name(gnutls_cipher_get(url->ss)));
+            return;
+    }
+    if (setsockopt(url->sockfd, SOL_TCP, TCP_ULP, "tls", sizeof("tls"))) {
+        /* no tls module, do not try again */
+        log_msg(L_WARN, "%s: %s: kTLS not available: %s.\n", argv0, url->tname, strerror(errno));
+        use_ktls = 0;
+        return;
+    }
+    if (setsockopt(url->sockfd, SOL_TLS, TLS_RX, &info, (socklen_t)size)) {
+        log_msg(L_WARN, "%s: %s: kTLS receive setup failed: %s.\n", argv0, url->tname, strerror(errno));
+        return;
+    }
+    url->ktls = 1;
+    log_msg(L_DEBUG, "%s: %s: kTLS enabled for receiving.\n", argv0, url->tname);
+}
+
+/*
+ * Records other than application data come with their type in a control
+ * message. Session tickets are skipped. An alert ends the connection, so
+ * does any other handshake message: a KeyUpdate changes the keys the
+ * kernel decrypts with and the stream cannot be read any further.
+ */
+static ssize_t ktls_read(struct_url * url, void * buf, size_t len)
+{
+    char control[CMSG_SPACE(sizeof(unsigned char))];
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr * cmsg;
+    ssize_t res;
+
+    while (1) {
+        iov.iov_base = buf;
+        iov.iov_len = len;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        res = recvmsg(url->sockfd, &msg, 0);
+        if (res <= 0)
+            return res;
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (!cmsg || cmsg->cmsg_level != SOL_TLS || cmsg->cmsg_type != TLS_GET_RECORD_TYPE
+                || *CMSG_DATA(cmsg) == 23 /* application data */)
+            return res;
+        if (*CMSG_DATA(cmsg) == 21) { /* alert */
+            log_msg(L_DEBUG, "%s: %s: kTLS: alert received.\n", argv0, url->tname);
+            return 0;
+        }
+        if (*CMSG_DATA(cmsg) == 22) { /* handshake, messages with 4 byte headers */
+            const unsigned char * m = buf;
+            ssize_t i = 0;
+            while (i + 4 <= res && m[i] == 4) /* NewSessionTicket */
+                i += 4 + (ssize_t)((size_t)m[i + 1] << 16 | (size_t)m[i + 2] << 8 | m[i + 3]);
+            if (i >= res)
+                continue;
+            log_msg(L_WARN, "%s: %s: kTLS: handshake message %d received, closing.\n",
+                    argv0, url->tname, m[i]);
+        } else
+            log_msg(L_WARN, "%s: %s: kTLS: record of type %d received, closing.\n",
+                    argv0, url->tname, *CMSG_DATA(cmsg));
+        errno = EIO;
+        return -1;
+    }
+}
+#endif
+#endif
+
+static void errno_report(const char * where)
+{
+    struct_url * url = thread_setup();
+    int e = errno;
+    log_msg(L_ERROR, "%s: %s: %s: %d %s.\n", argv0, url->tname, where, e, strerror(e));
+    errno = e;
+}
+
+static char * url_encode(char * path) {
+    return strdup(path); /*FIXME encode*/
+}
+
+/*
+ * functions for handling struct_url
+ */
+
+static int init_url(struct_url* url)
+{
     memset(url, 0, sizeof(*url));
     url->sock_type = SOCK_CLOSED;
     url->timeout = TIMEOUT;
+    url->stats = &stats_main;
 #ifdef RETRY_ON_RESET
     url->retry_reset = RESET_RETRIES;
 #endif
@@ -990,6 +2692,8 @@ static int free_url(struct_url* url)
 {
     if(url->sock_type != SOCK_CLOSED)
         close_client_force(url);
+    if(url->url) free(url->url);
+    url->url = 0;
     if(url->host) free(url->host);
     url->host = 0;
     if(url->path) free(url->path);
@@ -1007,7 +2711,7 @@ static int free_url(struct_url* url)
     return 0;
 }
 
-static void print_url(FILE *f, const struct_url * url)
+static void print_url(int level, const struct_url * url)
 {
     char * protocol = "?!?";
     switch(url->proto){
@@ -1020,13 +2724,13 @@ static void print_url(FILE *f, const struct_url * url)
             break;;
 #endif
     }
-    fprintf(f, "file name: \t%s\n", url->name);
-    fprintf(f, "host name: \t%s\n", url->host);
-    fprintf(f, "port number: \t%d\n", url->port);
-    fprintf(f, "protocol: \t%s\n", protocol);
-    fprintf(f, "request path: \t%s\n", url->path);
+    log_msg(level, "file name: \t%s\n", url->name);
+    log_msg(level, "host name: \t%s\n", url->host);
+    log_msg(level, "port number: \t%d\n", url->port);
+    log_msg(level, "protocol: \t%s\n", protocol);
+    log_msg(level, "request path: \t%s\n", url->path);
 #ifdef USE_AUTH
-    fprintf(f, "auth data: \t%s\n", url->auth ? "(present)" : "(null)");
+    log_msg(level, "auth data: \t%s\n", url->auth ? "(present)" : "(null)");
 #endif
 }
 
@@ -1075,7 +2779,7 @@ static int parse_url(char * _url, struct_url* res, enum url_flags flag)
         res->port = 443;
 #endif /* USE_SSL */
     } else {
-        fprintf(stderr, "Invalid protocol in url: %s\n", url_orig);
+        log_msg(L_ERROR, "Invalid protocol in url: %s\n", url_orig);
         return -1;
     }
 
@@ -1108,14 +2812,14 @@ static int parse_url(char * _url, struct_url* res, enum url_flags flag)
         /* FIXME check that port is a valid numeric value */
         res->port = atoi(strchr(url, ':') + 1);
         if (! res->port) {
-            fprintf(stderr, "Invalid port in url: %s\n", url_orig);
+            log_msg(L_ERROR, "Invalid port in url: %s\n", url_orig);
             return -1;
         }
         host_end = ':';
     }
     /* Get the host name. */
     if (url == strchr(url, host_end)){ /*no hastname in the url */
-        fprintf(stderr, "No hostname in url: %s\n", url_orig);
+        log_msg(L_ERROR, "No hostname in url: %s\n", url_orig);
         return -1;
     }
     if(res->host)
@@ -1147,167 +2851,1661 @@ static int parse_url(char * _url, struct_url* res, enum url_flags flag)
     return res->proto;
 }
 
-static void usage(void)
+/*
+ * Node table. The functions adding nodes expect files_lock held unless
+ * the filesystem is not mounted yet.
+ */
+
+static struct_file * node_get(fuse_ino_t ino)
 {
-    fprintf(stderr, "%s >>> Version: %s <<<\n", __FILE__, VERSION);
-    fprintf(stderr, "usage:  %s [-c [console]] "
-#ifdef USE_SSL
-            "[-a file] [-d n] [-5] [-2] "
+    struct_file * f = NULL;
+    if (ino == 1)
+        return &root_node;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&files_lock);
 #endif
-            "[-f] [-t timeout] [-r n] [-C filename] [-S n] url mount-parameters\n\n", argv0);
-#ifdef USE_SSL
-    fprintf(stderr, "\t -2 \tAllow RSA-MD2 server certificate\n");
-    fprintf(stderr, "\t -5 \tAllow RSA-MD5 server certificate\n");
-    fprintf(stderr, "\t -a \tCA file used to verify server certificate\n\t\t(default: %s)\n", CERT_STORE);
+    if (ino >= 2 && INO_FILE(ino) < files_count)
+        f = files[INO_FILE(ino)];
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&files_lock);
 #endif
-    fprintf(stderr, "\t -c \tuse console for standard input/output/error\n\t\t(default: %s)\n", CONSOLE);
-#ifdef USE_SSL
-    fprintf(stderr, "\t -d \tGNUTLS debug level (default 0)\n");
+    return f;
+}
+
+static struct_file * node_child(struct_file * dir, const char * name)
+{
+    struct_file * f = NULL;
+    size_t i;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&files_lock);
 #endif
-    fprintf(stderr, "\t -f \tstay in foreground - do not fork\n");
-#ifdef RETRY_ON_RESET
-    fprintf(stderr, "\t -r \tnumber of times to retry connection on reset\n\t\t(default: %i)\n", RESET_RETRIES);
+    for (i = 0; i < dir->children_count; i++)
+        if (!strcmp(name, dir->children[i]->name)) {
+            f = dir->children[i];
+            break;
+        }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&files_lock);
 #endif
-    fprintf(stderr, "\t -t \tset socket timeout in seconds (default: %i)\n", TIMEOUT);
-    fprintf(stderr, "\t -C \tset cache filename. also creates .idx file near to cache file\n");
-    fprintf(stderr, "\t -S \tset max size of cache file (default: %lld)\n", CACHEMAXSIZE);
-    fprintf(stderr, "\tmount-parameters should include the mount point\n");
+    return f;
 }
 
-#define shift { if(!argv[1] || !argv[2]) { usage(); return 4; };\
-    argc--; argv[1] = argv[0]; argv = argv + 1;}
+static struct_file * node_add(struct_file * dir, const char * name,
+        struct_url * url, const char * location)
+{
+    struct_file * f = calloc(1, sizeof(struct_file));
+    f->ino = FILE_INO(files_count);
+    f->parent = dir->ino;
+    f->name = strdup(name);
+    f->url = url;
+    f->remote_size = -1;
+    if (url)
+        url->ino = f->ino;
+    if (location)
+        f->location = strdup(location);
+    files = realloc(files, (files_count + 1) * sizeof(struct_file *));
+    files[files_count++] = f;
+    dir->children = realloc(dir->children, (dir->children_count + 1) * sizeof(struct_file *));
+    dir->children[dir->children_count++] = f;
+    return f;
+}
 
-static int convert_num(long * num, char ** argv)
+/* A new url with the connection options of main_url. It counts into
+ * stats_main, a caller that does requests with it sets url->stats to
+ * its own block. */
+
+static struct_url * new_url(char * location)
 {
-    char * end = " ";
-    if( isdigit(*(argv[1]))) {
-        *num = strtol(argv[1], &end, 0);
-        /* now end should point to '\0' */
-    }
-    if(*end){
-        usage();
-        fprintf(stderr, "'%s' is not a number.\n",
-                argv[1]);
-        return -1;
+    struct_url * url = malloc(sizeof(struct_url));
+    init_url(url);
+    url->timeout = main_url.timeout;
+#ifdef RETRY_ON_RESET
+    url->retry_reset = main_url.retry_reset;
+#endif
+#ifdef USE_SSL
+    url->ssl_log_level = main_url.ssl_log_level;
+    url->md5 = main_url.md5;
+    url->md2 = main_url.md2;
+    url->cafile = main_url.cafile;
+#endif
+    memcpy(url->tname, main_url.tname, TNAME_LEN + 1);
+    if(location && parse_url(location, url, URL_DUP) == -1) {
+        free_url(url);
+        free(url);
+        return NULL;
     }
-    return 0;
+    return url;
 }
 
-static int convert_num64(unsigned long long * num, char ** argv)
+static void set_fileid(struct_url * url, const char * location)
 {
-    char * end = " ";
-    if( isdigit(*(argv[1]))) {
-        *num = strtoull(argv[1], &end, 0);
-        /* now end should point to '\0' */
-    }
-    if(*end){
-        usage();
-        fprintf(stderr, "'%s' is not a number.\n",
-                argv[1]);
-        return -1;
-    }
-    return 0;
+    MD5_CTX ctx;
+    unsigned char digest[16];
+    MD5_Init(&ctx);
+    MD5_Update(&ctx, location, strlen(location));
+    MD5_Final(digest, &ctx);
+    memcpy(&url->fileid, digest, sizeof(url->fileid));
+    memcpy(&url->filecheck, digest + sizeof(url->fileid), sizeof(url->filecheck));
 }
 
+/*
+ * Add a file or, if the location ends with a slash, a directory listed
+ * from the server to the mount root. The first file can be main_url.
+ */
 
-int main(int argc, char *argv[])
+static struct_file * add_file(char * location, const char * name, struct_url * url)
 {
-    char * fork_terminal = CONSOLE;
-    char * cachename = NULL;
-    int do_fork = 1;
-    putenv("TZ=");/*UTC*/
-    argv0 = argv[0];
-    init_url(&main_url);
-    strncpy(main_url.tname, "main", TNAME_LEN);
-
-    while( argv[1] && (*(argv[1]) == '-') )
-    {
-        char * arg = argv[1]; shift;
-        while (*++arg){
-            switch (*arg){
-                case 'C': cachename = malloc(strlen(argv[1])+5); // 4 (".idx") + 1 '\0'
-                          strcpy(cachename, argv[1]);
-                          shift;
-                          break;
-                case 'S': if (convert_num64((unsigned long long*)(&cacheMaxSize), argv))
-                              return 5;
-                          shift;
-                          break;
-                case 'c': if( *(argv[1]) != '-' ) {
-                              fork_terminal = argv[1]; shift;
-                          }else{
-                              fork_terminal = 0;
-                          }
-                          break;
-#ifdef USE_SSL
-                case '2': main_url.md2 = GNUTLS_VERIFY_ALLOW_SIGN_RSA_MD2;
-                          break;
-                case '5': main_url.md5 = GNUTLS_VERIFY_ALLOW_SIGN_RSA_MD5;
-                          break;
-                case 'a': main_url.cafile = argv[1];
-                          shift;
-                          break;
-                case 'd': if (convert_num(&main_url.ssl_log_level, argv))
-                              return 4;
-                          shift;
-                          break;
-#endif
-#ifdef RETRY_ON_RESET
-                case 'r': if (convert_num(&main_url.retry_reset, argv))
-                              return 4;
-                          shift;
-                          break;
-#endif
-                case 't': if (convert_num(&main_url.timeout, argv))
-                              return 4;
-                          shift;
-                          break;
-                case 'f': do_fork = 0;
-                          break;
-                default:
-                          usage();
-                          fprintf(stderr, "Unknown option '%c'.\n", *arg);
-                          return 4;
-            }
-        }
+    int is_dir = location[strlen(location) - 1] == '/';
+    char * dname = NULL;
+
+    if (!url && !is_dir && !(url = new_url(location)))
+        return NULL;
+    if (!name && url) {
+        name = url->name;
+    } else if (!name) {
+        /* last path component of the directory */
+        struct_url * tmp = new_url(location);
+        if (!tmp)
+            return NULL;
+        dname = strdup(tmp->name);
+        free_url(tmp);
+        free(tmp);
+        name = dname;
     }
-
-    if (argc < 3) {
-        usage();
-        return 1;
+    if (strchr(name, '/') || !strcmp(name, ".") || !strcmp(name, "..")) {
+        fprintf(stderr, "Invalid file name '%s' for url: %s\n", name, location);
+        goto fail;
     }
-    if (cachename) {
-        if (init_cache(cachename) != 0){
-            fprintf(stderr, "err cache init\n");
-             return 5;
+    if (node_child(&root_node, name)) {
+        fprintf(stderr, "Duplicate file name '%s' for url: %s\n", name, location);
+        goto fail;
+    }
+    if (url) {
+        set_fileid(url, location);
+        if (name != url->name) {
+            free(url->name);
+            url->name = strdup(name);
         }
-        free(cachename);
     }
-    if(parse_url(argv[1], &main_url, URL_DUP) == -1){
-        fprintf(stderr, "invalid url: %s\n", argv[1]);
-        return 2;
+    {
+        struct_file * f = node_add(&root_node, name, url, is_dir ? location : NULL);
+        free(dname);
+        return f;
     }
-    print_url(stderr, &main_url);
-    int sockfd = open_client_socket(&main_url);
-    if(sockfd < 0) {
-        fprintf(stderr, "Connection failed.\n");
-        return 3;
+
+fail:
+    free(dname);
+    if (url && url != &main_url) {
+        free_url(url);
+        free(url);
     }
-#ifdef USE_SSL
-    else {
-        print_ssl_info(main_url.ss);
+    return NULL;
+}
+
+/*
+ * Read a list of files to mount, one per line: url [name]
+ * Empty lines and lines starting with # are ignored.
+ */
+
+static int load_file_list(const char * filename)
+{
+    char line[4096];
+    FILE * f = fopen(filename, "r");
+    int lineno = 0;
+
+    if (!f) {
+        fprintf(stderr, "Can't open url list %s: %s\n", filename, strerror(errno));
+        return -1;
     }
-#endif
-    close_client_socket(&main_url);
-    struct stat st;
-    off_t size = get_stat(&main_url, &st);
-    if(size >= 0) {
-        fprintf(stderr, "file size: \t%" PRIdMAX "\n", (intmax_t)size);
-    }else{
-        return 3;
+    while (fgets(line, sizeof(line), f)) {
+        char * location, * name;
+        lineno++;
+        location = strtok(line, " \t\r\n");
+        if (!location || *location == '#')
+            continue;
+        name = strtok(NULL, " \t\r\n");
+        if (!add_file(location, name, NULL)) {
+            fprintf(stderr, "%s:%i: invalid entry\n", filename, lineno);
+            fclose(f);
+            return -1;
+        }
     }
+    fclose(f);
+    return 0;
+}
 
-    shift;
+/*
+ * Directory listings. A directory is listed from its autoindex page as
+ * generated by nginx or Apache, or from a manifest file (-I) with one
+ * 'name[/] [size [mtime]]' line per entry. Sizes are used when the
+ * listing gives them in bytes so files need no HEAD to be stat()ed.
+ */
+
+typedef struct listing_entry {
+    char * name;
+    char * href; /* relative url */
+    int is_dir;
+    off_t size; /* -1 if not listed */
+    time_t mtime;
+} struct_listing_entry;
+
+/* Decode %XX escapes if decode_url is set and &amp; as found in links */
+static void url_decode(char * s, int decode_url)
+{
+    char * d = s;
+    for (; *s; s++, d++) {
+        if (decode_url && *s == '%' && isxdigit(s[1]) && isxdigit(s[2])) {
+            char hex[3] = { s[1], s[2], 0 };
+            *d = (char) strtol(hex, NULL, 16);
+            s += 2;
+        } else if (!strncmp(s, "&amp;", 5)) {
+            *d = '&';
+            s += 4;
+        } else
+            *d = *s;
+    }
+    *d = 0;
+}
+
+static char * url_escape(const char * name)
+{
+    char * res = malloc(strlen(name) * 3 + 1), * d = res;
+    for (; *name; name++) {
+        if (isalnum((unsigned char)*name) || strchr("-._~/", *name))
+            *d++ = *name;
+        else
+            d += sprintf(d, "%%%02X", (unsigned char)*name);
+    }
+    *d = 0;
+    return res;
+}
+
+static int listing_add(struct_listing_entry ** entries, size_t * count,
+        const char * href, size_t len)
+{
+    struct_listing_entry * e;
+    char * name;
+    size_t i;
+
+    if (!len || *href == '?' || *href == '#' || *href == '/' || *href == '.'
+            || memchr(href, ':', len))
+        return 0;
+    for (i = 0; i < len - 1; i++)
+        if (href[i] == '/')
+            return 0; /* not a direct child */
+    name = strndup(href, len);
+    *entries = realloc(*entries, (*count + 1) * sizeof(struct_listing_entry));
+    e = &(*entries)[(*count)++];
+    e->href = strndup(href, len);
+    url_decode(e->href, 0);
+    if ((e->is_dir = (name[len - 1] == '/')))
+        name[len - 1] = 0;
+    url_decode(name, 1);
+    e->name = name;
+    e->size = -1;
+    e->mtime = 0;
+    return 1;
+}
+
+/* Size and date following a link in an autoindex line */
+static void listing_details(const char * p, struct_listing_entry * e)
+{
+    char text[256], * tok[8];
+    size_t len = 0;
+    int n = 0, intag = 0;
+    struct tm tm;
+
+    for (; *p && *p != '\n' && len < sizeof(text) - 1; p++) {
+        if (*p == '<') intag = 1;
+        else if (*p == '>') { intag = 0; text[len++] = ' '; }
+        else if (!intag) text[len++] = *p;
+    }
+    text[len] = 0;
+    for (tok[n] = strtok(text, " \t\r"); tok[n] && n < 7; tok[n] = strtok(NULL, " \t\r"))
+        if (strcmp(tok[n], "&nbsp;")) n++;
+    if (n && !e->is_dir && strspn(tok[n - 1], "0123456789") == strlen(tok[n - 1]))
+        e->size = (off_t) strtoll(tok[n - 1], NULL, 10);
+    if (n >= 2) {
+        char date[64];
+        snprintf(date, sizeof(date), "%s %s", tok[0], tok[1]);
+        memset(&tm, 0, sizeof(tm));
+        if (strptime(date, "%d-%b-%Y %H:%M", &tm) || strptime(date, "%Y-%m-%d %H:%M", &tm))
+            e->mtime = mktime(&tm);
+    }
+}
+
+static size_t parse_autoindex(const char * body, struct_listing_entry ** entries)
+{
+    const char * p = body, * end;
+    size_t count = 0;
+
+    while ((p = strstr(p, "href=\""))) {
+        p += strlen("href=\"");
+        if (!(end = strchr(p, '"')))
+            break;
+        if (listing_add(entries, &count, p, (size_t)(end - p))) {
+            const char * a = strstr(end, "</a>");
+            const char * eol = strchr(end, '\n');
+            if (a && (!eol || a < eol))
+                listing_details(a + strlen("</a>"), &(*entries)[count - 1]);
+        }
+        p = end;
+    }
+    return count;
+}
+
+static size_t parse_manifest(char * body, struct_listing_entry ** entries)
+{
+    char * line, * save = NULL;
+    size_t count = 0;
+
+    for (line = strtok_r(body, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+        char * name, * size, * mtime, * href, * lsave = NULL;
+        if (!(name = strtok_r(line, " \t\r", &lsave)) || *name == '#')
+            continue;
+        size = strtok_r(NULL, " \t\r", &lsave);
+        mtime = strtok_r(NULL, " \t\r", &lsave);
+        href = url_escape(name);
+        if (listing_add(entries, &count, href, strlen(href))) {
+            if (size && isdigit(*size))
+                (*entries)[count - 1].size = (off_t) strtoll(size, NULL, 10);
+            if (mtime && isdigit(*mtime))
+                (*entries)[count - 1].mtime = (time_t) strtoll(mtime, NULL, 10);
+        }
+        free(href);
+    }
+    return count;
+}
+
+/*
+ * Fetch a whole document. HTTP/1.0 is used so the reply is not chunked,
+ * the connection is closed afterwards.
+ */
+
+static char * fetch_listing(const char * location, size_t * length)
+{
+    char * loc = strdup(location), * body = NULL;
+    struct_url * url = new_url(NULL);
+    int redirects = 0;
+
+    url->stats = thread_setup()->stats;
+    memcpy(url->tname, thread_setup()->tname, TNAME_LEN + 1);
+    errno = EIO;
+    while (redirects++ < MAX_REDIRECTS) {
+        char req[HEADER_SIZE], * hend, * p;
+        size_t size = 0, alloc = HEADER_SIZE;
+        ssize_t res;
+        int status, n;
+
+        if (parse_url(loc, url, URL_SAVE) == -1) {
+            loc = NULL;
+            break;
+        }
+        loc = NULL; /* owned by url now */
+        n = snprintf(req, sizeof(req), "GET %s HTTP/1.0\r\nHost: %s\r\n"
+                "User-Agent: %s %s\r\n", url->path, url->host, __FILE__, VERSION);
+#ifdef USE_AUTH
+        if (url->auth)
+            n += snprintf(req + n, sizeof(req) - (size_t)n,
+                    "Authorization: Basic %s\r\n", url->auth);
+#endif
+        n += snprintf(req + n, sizeof(req) - (size_t)n, "\r\n");
+        if (write_client_socket(url, req, (size_t)n) <= 0)
+            break;
+        body = malloc(alloc + 1);
+        while ((res = read_client_socket(url, body + size, alloc - size)) > 0) {
+            size += (size_t)res;
+            if (size == alloc) {
+                if (alloc >= MAX_LISTING) {
+                    log_msg(L_ERROR, "%s: %s: listing %s too large.\n", argv0, url->tname, url->url);
+                    size = 0;
+                    break;
+                }
+                alloc *= 2;
+                body = realloc(body, alloc + 1);
+            }
+        }
+        close_client_force(url);
+        body[size] = 0;
+        if (size < 12 || strncmp(body, "HTTP/1.", 7)
+                || !(hend = strstr(body, "\r\n\r\n"))) {
+            http_report("invalid listing reply", "GET", body, min(size, HEADER_SIZE));
+            break;
+        }
+        status = atoi(body + 9);
+        if (status == 301 || status == 302 || status == 303 || status == 307) {
+            for (p = strchr(body, '\n'); p && p < hend; p = strchr(p + 1, '\n'))
+                if (mempref(p + 1, "Location: ", (size_t)(hend - p), 0)) {
+                    size_t len = strcspn(p + 11, "\r\n");
+                    const char * proto = url->proto == PROTO_HTTP ? "http" : "https";
+                    if (p[11] == '/' && p[12] == '/') { /* relative to the scheme */
+                        loc = malloc(len + 8);
+                        sprintf(loc, "%s:%.*s", proto, (int)len, p + 11);
+                    } else if (p[11] == '/') { /* relative to the server */
+                        loc = malloc(len + strlen(url->host) + 32);
+                        sprintf(loc, "%s://%s:%i%.*s", proto,
+                                url->host, url->port, (int)len, p + 11);
+                    } else if (p[11 + strcspn(p + 11, ":/?#\r\n")] != ':') {
+                        /* relative to the directory of the request */
+                        int dir = (int)(strrchr(url->path, '/') - url->path) + 1;
+                        loc = malloc(len + strlen(url->host) + strlen(url->path) + 32);
+                        sprintf(loc, "%s://%s:%i%.*s%.*s", proto,
+                                url->host, url->port, dir, url->path, (int)len, p + 11);
+                    } else
+                        loc = strndup(p + 11, len);
+                    break;
+                }
+            free(body);
+            body = NULL;
+            if (!loc)
+                break;
+            continue;
+        }
+        if (status != 200) {
+            log_msg(L_ERROR, "%s: %s: listing %s failed with status %d.\n",
+                    argv0, url->tname, url->url, status);
+            errno = status == 404 ? ENOENT : EIO;
+            free(body);
+            body = NULL;
+            break;
+        }
+        hend += 4;
+        *length = size - (size_t)(hend - body);
+        memmove(body, hend, *length + 1);
+        break;
+    }
+    free(loc);
+    free_url(url);
+    free(url);
+    return body;
+}
+
+/*
+ * Make sure the directory listing is not older than dir_ttl. When the
+ * server cannot be reached an older listing is kept. Only one thread
+ * fetches the listing of a directory, the others take its result.
+ */
+
+#ifdef USE_THREAD
+pthread_cond_t dir_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void dir_listed(struct_file * dir, int err)
+{
+    dir->listing = 0;
+    dir->list_errno = err;
+#ifdef USE_THREAD
+    pthread_cond_broadcast(&dir_cond);
+#endif
+}
+
+static int dir_refresh(struct_file * dir)
+{
+    struct_listing_entry * entries = NULL;
+    struct_file ** children;
+    fuse_ino_t * changed;
+    size_t count, i, changed_count = 0, length;
+    char * location, * body;
+    time_t now = time(NULL);
+
+    if (!dir->location)
+        return 0;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&files_lock);
+    if (dir->listing) {
+        while (dir->listing)
+            pthread_cond_wait(&dir_cond, &files_lock);
+        i = dir->listed ? 0 : (size_t)dir->list_errno;
+        pthread_mutex_unlock(&files_lock);
+        if (i) {
+            errno = (int)i;
+            return -1;
+        }
+        return 0;
+    }
+#endif
+    i = dir->listed && (now - dir->listed < dir_ttl);
+    if (!i)
+        dir->listing = 1;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&files_lock);
+#endif
+    if (i)
+        return 0;
+
+    location = malloc(strlen(dir->location) + (dir_manifest ? strlen(dir_manifest) : 0) + 1);
+    strcpy(location, dir->location);
+    if (dir_manifest)
+        strcat(location, dir_manifest);
+    log_msg(L_INFO, "%s: %s: listing %s\n", argv0, thread_setup()->tname, location);
+    body = fetch_listing(location, &length);
+    free(location);
+    if (!body) {
+        int err = errno;
+#ifdef USE_THREAD
+        pthread_mutex_lock(&files_lock);
+#endif
+        dir_listed(dir, err);
+        i = dir->listed != 0;
+#ifdef USE_THREAD
+        pthread_mutex_unlock(&files_lock);
+#endif
+        errno = err;
+        return i ? 0 : -1;
+    }
+    count = dir_manifest ? parse_manifest(body, &entries) : parse_autoindex(body, &entries);
+    free(body);
+
+    changed = malloc((count + 1) * sizeof(fuse_ino_t));
+#ifdef USE_THREAD
+    pthread_mutex_lock(&files_lock);
+#endif
+    children = malloc((count + dir->children_count + 1) * sizeof(struct_file *));
+    for (i = 0; i < count; i++) {
+        struct_listing_entry * e = &entries[i];
+        struct_file * f = NULL;
+        size_t j;
+        children[i] = NULL;
+        for (j = 0; j < dir->children_count; j++)
+            if (!strcmp(e->name, dir->children[j]->name)) {
+                f = dir->children[j];
+                break;
+            }
+        if (f && f->content)
+            continue; /* generated files hide remote ones */
+        if (f && (NODE_IS_DIR(f) != (e->is_dir != 0)))
+            f = NULL; /* replaced by a different kind of entry */
+        for (j = 0; !f && j < dir->gone_count; j++)
+            if (!strcmp(e->name, dir->gone[j]->name)
+                    && NODE_IS_DIR(dir->gone[j]) == (e->is_dir != 0)) {
+                f = dir->gone[j];
+                dir->gone[j] = dir->gone[--dir->gone_count];
+            }
+        if (!f) {
+            char * child = malloc(strlen(dir->location) + strlen(e->href) + 1);
+            struct_url * url = NULL;
+            strcpy(child, dir->location);
+            strcat(child, e->href);
+            if (!e->is_dir && !(url = new_url(child))) {
+                free(child);
+                continue;
+            }
+            if (url) {
+                set_fileid(url, child);
+                free(url->name);
+                url->name = strdup(e->name);
+            }
+            /* node_add appends to dir->children, the array is rebuilt below */
+            f = node_add(dir, e->name, url, e->is_dir ? child : NULL);
+            free(child);
+        } else if (f->url && f->size_listed && e->size >= 0
+                && (f->remote_size != e->size || f->remote_mtime != e->mtime))
+            changed[changed_count++] = f->ino;
+        if (f->url && e->size >= 0) {
+            f->remote_size = e->size;
+            f->remote_mtime = e->mtime;
+            f->size_listed = 1;
+        }
+        children[i] = f;
+    }
+    /* entries not listed any more disappear from the directory */
+    for (i = 0, length = 0; i < count; i++)
+        if (children[i]) {
+            size_t j;
+            for (j = 0; j < length && children[j] != children[i]; j++);
+            if (j == length)
+                children[length++] = children[i];
+        }
+    for (i = 0; i < dir->children_count; i++) {
+        size_t j;
+        if (dir->children[i]->content) {
+            children[length++] = dir->children[i];
+            continue;
+        }
+        for (j = 0; j < length && children[j] != dir->children[i]; j++);
+        if (j == length) {
+            dir->gone = realloc(dir->gone, (dir->gone_count + 1) * sizeof(struct_file *));
+            dir->gone[dir->gone_count++] = dir->children[i];
+        }
+    }
+    free(dir->children);
+    dir->children = children;
+    dir->children_count = length;
+    dir->listed = now;
+    dir_listed(dir, 0);
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&files_lock);
+#endif
+
+    for (i = 0; i < changed_count; i++)
+        inval_add(changed[i]);
+    free(changed);
+    for (i = 0; i < count; i++) {
+        free(entries[i].name);
+        free(entries[i].href);
+    }
+    free(entries);
+    return 0;
+}
+
+// ========== INVALIDATION ============
+/*
+ * The kernel page cache of a file that changed on the server is dropped
+ * only after the request that noticed it was answered. The kernel can
+ * hold the pages of the file locked for that request, invalidating them
+ * from its handler may never return. With threads a helper thread takes
+ * the queued inodes, without the request loop does between requests.
+ */
+static fuse_ino_t * inval_queue = NULL;
+static size_t inval_count = 0, inval_alloc = 0;
+#ifdef USE_THREAD
+static int inval_stop = 0;
+static int inval_running = 0;
+static pthread_t inval_thread_id;
+pthread_mutex_t inval_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inval_cond = PTHREAD_COND_INITIALIZER;
+#endif
+
+static void inval_add(fuse_ino_t ino)
+{
+    size_t i;
+
+    if (!fuse_ch)
+        return;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&inval_lock);
+#endif
+    for (i = 0; i < inval_count && inval_queue[i] != ino; i++);
+    if (i == inval_count) {
+        if (inval_count == inval_alloc) {
+            inval_alloc = inval_alloc ? inval_alloc * 2 : 16;
+            inval_queue = realloc(inval_queue, inval_alloc * sizeof(fuse_ino_t));
+        }
+        inval_queue[inval_count++] = ino;
+    }
+#ifdef USE_THREAD
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+#endif
+}
+
+static void inval_flush(void)
+{
+#ifdef USE_THREAD
+    pthread_mutex_lock(&inval_lock);
+#endif
+    while (inval_count) {
+        fuse_ino_t ino = inval_queue[--inval_count];
+        int res;
+#ifdef USE_THREAD
+        pthread_mutex_unlock(&inval_lock);
+#endif
+        res = fuse_lowlevel_notify_inval_inode(fuse_ch, ino, 0, 0);
+        if (res && res != -ENOENT) {
+            errno = -res;
+            errno_report("invalidate page cache");
+        }
+#ifdef USE_THREAD
+        pthread_mutex_lock(&inval_lock);
+#endif
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&inval_lock);
+#endif
+}
+
+#ifdef USE_THREAD
+static void * inval_thread(void * arg)
+{
+    (void) arg;
+    pthread_mutex_lock(&inval_lock);
+    while (!inval_stop) {
+        if (!inval_count) {
+            pthread_cond_wait(&inval_cond, &inval_lock);
+            continue;
+        }
+        pthread_mutex_unlock(&inval_lock);
+        inval_flush();
+        pthread_mutex_lock(&inval_lock);
+    }
+    pthread_mutex_unlock(&inval_lock);
+    return NULL;
+}
+
+static void inval_start(void)
+{
+    if (pthread_create(&inval_thread_id, NULL, inval_thread, NULL))
+        errno_report("invalidation thread");
+    else
+        inval_running = 1;
+}
+
+static void inval_finish(void)
+{
+    if (!inval_running)
+        return;
+    pthread_mutex_lock(&inval_lock);
+    inval_stop = 1;
+    pthread_cond_signal(&inval_cond);
+    pthread_mutex_unlock(&inval_lock);
+    pthread_join(inval_thread_id, NULL);
+}
+#else
+/* fuse_session_loop() with the queued invalidations done between requests */
+static int inval_loop(struct fuse_session * se)
+{
+    struct fuse_chan * ch = fuse_session_next_chan(se, NULL);
+    size_t bufsize = fuse_chan_bufsize(ch);
+    char * buf = malloc(bufsize);
+    int res = 0;
+
+    while (!fuse_session_exited(se)) {
+        struct fuse_chan * tmpch = ch;
+        struct fuse_buf fbuf = { .mem = buf, .size = bufsize };
+
+        res = fuse_session_receive_buf(se, &fbuf, &tmpch);
+        if (res == -EINTR)
+            continue;
+        if (res <= 0)
+            break;
+        fuse_session_process_buf(se, &fbuf, tmpch);
+        inval_flush();
+    }
+    free(buf);
+    fuse_session_reset(se);
+    return res < 0 ? -1 : 0;
+}
+#endif
+
+// ========== END INVALIDATION ============
+
+// ========== SCHEDULER ============
+/*
+ * Requests to the servers are made in three classes: the reads the
+ * kernel waits for (demand), the metadata the -F format prefetch expects
+ * to be read next (readahead) and the ranges of a -p profile
+ * (background). A request is not sent while requests of a higher class
+ * are in flight, so prefetching only uses what the kernel reads leave
+ * idle. Background requests are also paced to -b bytes per second.
+ * Calls nest, only the outermost waits and counts, so a prefetch thread
+ * can wait before it claims a range and get_data() does not wait again.
+ */
+enum sched_class {
+    SC_DEMAND,
+    SC_READAHEAD,
+    SC_BACKGROUND,
+    SC_CLASSES
+};
+
+#ifdef USE_THREAD
+static long background_rate = 0; /* bytes per second, -b */
+static unsigned sched_active[SC_CLASSES];
+static uint64_t sched_background_next = 0; /* start of the next background request */
+pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+static void sched_enter(struct_url * url, size_t size)
+{
+    uint64_t now, start = 0;
+    int c;
+
+    if (url->sched_depth++)
+        return;
+    pthread_mutex_lock(&sched_lock);
+    if (url->sched == SC_BACKGROUND && background_rate > 0) {
+        now = now_us();
+        start = sched_background_next > now ? sched_background_next : now;
+        sched_background_next = start + (uint64_t)size * 1000000 / (uint64_t)background_rate;
+        if (start > now) {
+            pthread_mutex_unlock(&sched_lock);
+            usleep((useconds_t)(start - now));
+            pthread_mutex_lock(&sched_lock);
+        }
+    }
+    for (c = 0; c < url->sched; c++)
+        if (sched_active[c]) {
+            pthread_cond_wait(&sched_cond, &sched_lock);
+            c = -1;
+        }
+    sched_active[url->sched]++;
+    pthread_mutex_unlock(&sched_lock);
+}
+
+static void sched_leave(struct_url * url)
+{
+    if (--url->sched_depth)
+        return;
+    pthread_mutex_lock(&sched_lock);
+    if (!--sched_active[url->sched] && url->sched < SC_BACKGROUND)
+        pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+#else
+/* only the prefetch threads make other than demand requests */
+static void sched_enter(struct_url * url, size_t size) { }
+static void sched_leave(struct_url * url) { }
+#endif
+
+// ========== END SCHEDULER ============
+
+// ========== PREFETCH ============
+/*
+ * Reads recorded with -P are written to the profile as lines of
+ * 'offset size msec fileid url', msec counted from the mount and the
+ * fileid written as 32 hex digits together with its check. A profile
+ * given with -p is loaded at mount and the ranges are fetched by
+ * PREFETCH_THREADS threads in the order of first use. With -C the data
+ * goes to the cache, otherwise it is kept in memory (up to PREFETCH_RAM)
+ * until the kernel reads it. A read of a range being prefetched waits for
+ * it, a read of a range not started yet takes it over. Data in memory is
+ * freed once read up to its end, when its file is released or, while it
+ * holds back other ranges, PREFETCH_KEEP seconds after it arrived.
+ */
+#define PREFETCH_THREADS 4
+#define PREFETCH_RAM (64*1024*1024)
+#define PREFETCH_KEEP 30
+#define PREFETCH_HASH 4096
+#define PREFETCH_CHUNK (1024*1024) /* request size of the format prefetch */
+#define FORMAT_PREFETCH_MAX (64*1024*1024)
+
+enum prefetch_state {
+    PF_QUEUED,
+    PF_FETCHING,
+    PF_DONE,
+    PF_FAILED,
+    PF_TAKEN, /* read by the kernel or fetched on demand */
+};
+
+typedef struct prefetch struct_prefetch;
+struct prefetch {
+    uint64_t fileid;
+    uint64_t filecheck;
+    const char * location; /* shared by the ranges of one file */
+    off_t off;
+    size_t size;
+    enum prefetch_state state;
+    char * data; /* without a cache the data is kept here */
+    size_t used; /* end of the data read by the kernel so far, from off */
+    uint64_t done; /* when the data arrived */
+    enum sched_class sched; /* readahead ranges are fetched first */
+    struct_file * table; /* an ISO9660 path table, see iso_path_table() */
+    struct_prefetch * next; /* queue in fetch order */
+    struct_prefetch * hnext;
+};
+
+static FILE * profile_out = NULL;
+static uint64_t profile_start;
+#ifdef USE_THREAD
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void profile_record(struct_url * url, off_t off, size_t size)
+{
+    if (!profile_out)
+        return;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&profile_lock);
+#endif
+    fprintf(profile_out, "%" PRIdMAX " %zu %lu %016" PRIx64 "%016" PRIx64 " %s\n", (intmax_t)off, size,
+            (unsigned long)((now_us() - profile_start) / 1000), url->fileid, url->filecheck, url->url);
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+#ifdef USE_THREAD
+static struct_prefetch * prefetch_hash[PREFETCH_HASH];
+static struct_prefetch * prefetch_head = NULL, ** prefetch_tail = &prefetch_head;
+static struct_prefetch * prefetch_next = NULL; /* first range that may be queued */
+static size_t prefetch_ram = 0;
+static size_t prefetch_readahead = 0; /* queued readahead ranges */
+static int prefetch_stop = 0;
+static pthread_t prefetch_threads[PREFETCH_THREADS];
+static int prefetch_running = 0;
+pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+
+#define PREFETCH_KEY(fileid, off) (((fileid) ^ (uint64_t)((off) >> 12)) % PREFETCH_HASH)
+
+/* prefetch_lock held */
+static struct_prefetch * prefetch_find(uint64_t fileid, off_t off)
+{
+    struct_prefetch * e = prefetch_hash[PREFETCH_KEY(fileid, off)];
+    while (e && (e->fileid != fileid || e->off != off))
+        e = e->hnext;
+    return e;
+}
+
+/* Queue a range unless it is known already, prefetch_lock held */
+static struct_prefetch * prefetch_add(uint64_t fileid, uint64_t filecheck,
+        const char * location, off_t off, size_t size, enum sched_class sched)
+{
+    struct_prefetch * e = prefetch_find(fileid, off);
+    if (e && e->size >= size)
+        return e;
+    e = calloc(1, sizeof(struct_prefetch));
+    e->fileid = fileid;
+    e->filecheck = filecheck;
+    e->location = location;
+    e->off = off;
+    e->size = size;
+    e->sched = sched;
+    if (sched == SC_READAHEAD)
+        prefetch_readahead++;
+    e->hnext = prefetch_hash[PREFETCH_KEY(fileid, off)];
+    prefetch_hash[PREFETCH_KEY(fileid, off)] = e;
+    *prefetch_tail = e;
+    prefetch_tail = &e->next;
+    if (!prefetch_next)
+        prefetch_next = e;
+    pthread_cond_broadcast(&prefetch_cond);
+    return e;
+}
+
+/* Free the data of a range kept in memory, prefetch_lock held */
+static void prefetch_free(struct_prefetch * e)
+{
+    free(e->data);
+    e->data = NULL;
+    e->state = PF_TAKEN;
+    prefetch_ram -= e->size;
+    pthread_cond_broadcast(&prefetch_cond);
+}
+
+/*
+ * Free the data of the ranges of a file, or with fileid 0 of the ranges
+ * not read for PREFETCH_KEEP seconds. Returns how many were freed.
+ * prefetch_lock held
+ */
+static int prefetch_expire(uint64_t fileid)
+{
+    uint64_t now = now_us();
+    struct_prefetch * e;
+    int freed = 0;
+
+    for (e = prefetch_head; e; e = e->next)
+        if (e->data && (fileid ? e->fileid == fileid
+                    : now - e->done > (uint64_t)PREFETCH_KEEP * 1000000)) {
+            prefetch_free(e);
+            freed++;
+        }
+    return freed;
+}
+
+/* The file was closed, what it did not read of its ranges is not kept */
+static void prefetch_release(uint64_t fileid)
+{
+    if (!prefetch_running)
+        return;
+    pthread_mutex_lock(&prefetch_lock);
+    prefetch_expire(fileid);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/*
+ * Called before a read goes to get_data(). Returns the number of bytes
+ * copied to url->req_buf from a range prefetched to memory, 0 when the
+ * read has to be done by get_data(), which finds prefetched ranges in
+ * the cache.
+ */
+static size_t prefetch_take(struct_url * url, off_t off, size_t size)
+{
+    struct_prefetch * e;
+    size_t res = 0;
+
+    if (!prefetch_running)
+        return 0;
+    pthread_mutex_lock(&prefetch_lock);
+    e = prefetch_find(url->fileid, off);
+    if (!e || e->size < size) {
+        /* a read inside one of the aligned chunks of the format prefetch */
+        e = prefetch_find(url->fileid, off - off % PREFETCH_CHUNK);
+        if (e && e->off + (off_t)e->size < off + (off_t)size)
+            e = NULL;
+    }
+    if (e) {
+        /* a path table is left to the prefetch thread to look into, a
+         * read of the start of a larger range leaves the rest queued */
+        if (e->state == PF_QUEUED && e->off == off && e->size <= size && !e->table) {
+            e->state = PF_TAKEN;
+            if (e->sched == SC_READAHEAD)
+                prefetch_readahead--;
+        }
+        while (e->state == PF_FETCHING)
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        if (e->state == PF_DONE && e->data) {
+            size_t end = (size_t)(off - e->off) + size;
+            memcpy(url->req_buf, e->data + (off - e->off), size);
+            /* the kernel reads ahead, the range is done when its end was
+             * read, reading the same bytes again does not count */
+            if (end > e->used)
+                e->used = end;
+            if (e->used >= e->size)
+                prefetch_free(e);
+            STAT_ADD(url, ST_PREFETCH_HITS, 1);
+            STAT_ADD(url, ST_BYTES_CACHE, size);
+            res = size;
+        }
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    return res;
+}
+
+static void * prefetch_thread(void * arg)
+{
+    struct {
+        const char * location;
+        struct_url * url;
+    } * urls = NULL;
+    size_t count = 0, i;
+    struct_stats * stats = thread_setup()->stats;
+
+    (void) arg;
+    pthread_mutex_lock(&prefetch_lock);
+    while (1) {
+        struct_prefetch * e;
+        struct_url * url = NULL;
+        struct_file * table;
+        ssize_t res;
+
+        while (prefetch_next && prefetch_next->state != PF_QUEUED)
+            prefetch_next = prefetch_next->next;
+        e = prefetch_next;
+        if (prefetch_readahead)
+            while (e && (e->state != PF_QUEUED || e->sched != SC_READAHEAD))
+                e = e->next;
+        if (prefetch_stop)
+            break;
+        if (!e) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+            continue;
+        }
+        if (fdcache <= 0 && prefetch_ram && prefetch_ram + e->size > PREFETCH_RAM) {
+            struct timespec ts;
+            if (prefetch_expire(0))
+                continue;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec++;
+            pthread_cond_timedwait(&prefetch_cond, &prefetch_lock, &ts);
+            continue;
+        }
+        pthread_mutex_unlock(&prefetch_lock);
+
+        for (i = 0; i < count; i++)
+            if (urls[i].location == e->location)
+                url = urls[i].url;
+        if (!url && (url = new_url((char *)e->location))) {
+            url->fileid = e->fileid;
+            url->filecheck = e->filecheck;
+            url->stats = stats;
+            snprintf(url->tname, TNAME_LEN + 1, "%0*lX", TNAME_LEN, pthread_self());
+            urls = realloc(urls, (count + 1) * sizeof(*urls));
+            urls[count].location = e->location;
+            urls[count++].url = url;
+        }
+        /* the range is claimed only when it can be fetched, until then
+         * a read of it takes it over instead of waiting behind it */
+        if (url) {
+            url->sched = e->sched;
+            sched_enter(url, e->size);
+        }
+        pthread_mutex_lock(&prefetch_lock);
+        if (e->state != PF_QUEUED) {
+            if (url)
+                sched_leave(url);
+            continue;
+        }
+        e->state = PF_FETCHING;
+        if (e->sched == SC_READAHEAD)
+            prefetch_readahead--;
+        if (fdcache <= 0)
+            prefetch_ram += e->size;
+        table = e->table;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        res = -1;
+        if (url) {
+            url->req_buf = malloc(e->size);
+            url->req_buf_size = e->size;
+            res = get_data(url, e->off, e->size);
+            if (table && res == (ssize_t)e->size)
+                iso_path_table(table, (const unsigned char *)url->req_buf, e->size);
+            sched_leave(url);
+        }
+
+        pthread_mutex_lock(&prefetch_lock);
+        e->state = (res == (ssize_t)e->size) ? PF_DONE : PF_FAILED;
+        if (e->state == PF_DONE && fdcache <= 0) {
+            e->data = url->req_buf;
+            e->done = now_us();
+        } else {
+            if (fdcache <= 0)
+                prefetch_ram -= e->size;
+            if (url)
+                free(url->req_buf);
+        }
+        if (url)
+            url->req_buf = NULL;
+        pthread_cond_broadcast(&prefetch_cond);
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    for (i = 0; i < count; i++) {
+        free_url(urls[i].url);
+        free(urls[i].url);
+    }
+    free(urls);
+    return NULL;
+}
+
+/* Queue the ranges of a profile written with -P */
+static int prefetch_load(const char * filename)
+{
+    FILE * f = fopen(filename, "r");
+    char line[4096];
+    const char ** locations = NULL;
+    size_t count = 0, ranges = 0, i;
+
+    if (!f) {
+        fprintf(stderr, "Can't open profile %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_lock(&prefetch_lock);
+    while (fgets(line, sizeof(line), f)) {
+        intmax_t off;
+        size_t size;
+        unsigned long msec;
+        uint64_t fileid, filecheck;
+        int pos = 0;
+        char * location;
+
+        if (sscanf(line, "%jd %zu %lu %16" SCNx64 "%16" SCNx64 " %n",
+                    &off, &size, &msec, &fileid, &filecheck, &pos) < 5 || !pos || !size)
+            continue;
+        location = line + pos;
+        location[strcspn(location, "\r\n")] = 0;
+        for (i = 0; i < count && strcmp(locations[i], location); i++);
+        if (i == count) {
+            locations = realloc(locations, (count + 1) * sizeof(char *));
+            locations[count++] = strdup(location);
+        }
+        prefetch_add(fileid, filecheck, locations[i], (off_t)off, size, SC_BACKGROUND);
+        ranges++;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+    fclose(f);
+    free(locations); /* the strings stay referenced by the ranges */
+    fprintf(stderr, "profile: \t%zu reads of %zu files\n", ranges, count);
+    return 0;
+}
+
+/*
+ * Format aware prefetch (-F). When the start of a file is read and it is
+ * a squashfs or ISO9660 image the regions holding the metadata the kernel
+ * reads next in small scattered reads are queued for the prefetch threads
+ * in PREFETCH_CHUNK sized aligned pieces.
+ */
+#define SQUASHFS_MAGIC 0x73717368 /* "hsqs" */
+#define ISO_SECTOR 2048
+#define ISO_GAP (64*1024) /* directories closer than this are fetched together */
+
+static int format_prefetch = 0;
+
+static uint64_t get_le(const unsigned char * p, int bytes)
+{
+    uint64_t v = 0;
+    while (bytes--)
+        v = (v << 8) | p[bytes];
+    return v;
+}
+
+static void format_prefetch_range(struct_file * f, off_t start, off_t end)
+{
+    off_t size = get_file_size(f), off;
+    if (end > size)
+        end = size;
+    if (end - start > FORMAT_PREFETCH_MAX)
+        end = start + FORMAT_PREFETCH_MAX;
+    if (start < 0 || start >= end)
+        return;
+    log_msg(L_INFO, "%s: %s: prefetching metadata %" PRIdMAX "-%" PRIdMAX "\n",
+            argv0, f->name, (intmax_t)start, (intmax_t)end);
+    pthread_mutex_lock(&prefetch_lock);
+    for (off = start - start % PREFETCH_CHUNK; off < end; off += PREFETCH_CHUNK)
+        prefetch_add(f->url->fileid, f->url->filecheck, f->url->url, off,
+                (size_t)min((off_t)PREFETCH_CHUNK, size - off), SC_READAHEAD);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+static int compare_extent(const void * a, const void * b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * Directories are listed in the path tables of the volume descriptors.
+ * The tables are queued for the prefetch threads, which pass them to
+ * iso_path_table() when they arrive.
+ */
+static void iso_prefetch(struct_file * f, const unsigned char * buf, size_t len)
+{
+    size_t sector;
+
+    for (sector = 16; (sector + 1) * ISO_SECTOR <= len; sector++) {
+        const unsigned char * d = buf + sector * ISO_SECTOR;
+        size_t table_size;
+        struct_prefetch * e;
+
+        if (memcmp(d + 1, "CD001", 5) || d[0] == 255)
+            break;
+        if (d[0] != 1 && d[0] != 2) /* primary and Joliet descriptors */
+            continue;
+        table_size = (size_t)get_le(d + 132, 4);
+        if (!table_size || table_size > PREFETCH_CHUNK)
+            continue;
+        pthread_mutex_lock(&prefetch_lock);
+        e = prefetch_add(f->url->fileid, f->url->filecheck, f->url->url,
+                (off_t)get_le(d + 140, 4) * ISO_SECTOR, table_size, SC_READAHEAD);
+        if (e->state == PF_QUEUED)
+            e->table = f;
+        pthread_mutex_unlock(&prefetch_lock);
+    }
+}
+
+/* Queue the directories listed in a path table, on a prefetch thread */
+static void iso_path_table(struct_file * f, const unsigned char * table, size_t table_size)
+{
+    uint32_t * extents = NULL;
+    size_t count = 0, i, pos;
+
+    for (pos = 0; pos + 8 <= table_size && table[pos]; pos += 8 + (size_t)table[pos] + (table[pos] & 1u)) {
+        extents = realloc(extents, (count + 1) * sizeof(uint32_t));
+        extents[count++] = (uint32_t)get_le(table + pos + 2, 4);
+    }
+    if (!count)
+        return;
+    qsort(extents, count, sizeof(uint32_t), compare_extent);
+    for (i = 0; i < count; ) {
+        size_t j = i;
+        while (j + 1 < count && ((off_t)extents[j + 1] - extents[j]) * ISO_SECTOR <= ISO_GAP)
+            j++;
+        format_prefetch_range(f, (off_t)extents[i] * ISO_SECTOR, ((off_t)extents[j] + 1) * ISO_SECTOR);
+        i = j + 1;
+    }
+    free(extents);
+}
+
+/*
+ * Called with the data of a read at offset 0, after the reply. A read
+ * too short to tell the format leaves the probe to a later one.
+ */
+static void format_probe(struct_file * f, const char * data, size_t len)
+{
+    const unsigned char * buf = (const unsigned char *)data;
+    int squashfs = len >= 96 && get_le(buf, 4) == SQUASHFS_MAGIC && get_le(buf + 28, 2) == 4;
+    int probed;
+
+    if (!format_prefetch || (!squashfs && len < 17 * ISO_SECTOR))
+        return;
+    pthread_mutex_lock(&files_lock);
+    probed = f->probed;
+    f->probed = 1;
+    pthread_mutex_unlock(&files_lock);
+    if (probed)
+        return;
+    if (squashfs) {
+        /* the inode, directory, fragment, export, id and xattr tables are
+         * stored in this order from the inode table to the end */
+        format_prefetch_range(f, (off_t)get_le(buf + 64, 8), (off_t)get_le(buf + 40, 8));
+    } else if (!memcmp(buf + 16 * ISO_SECTOR + 1, "CD001", 5))
+        iso_prefetch(f, buf, len);
+}
+
+static void prefetch_start(void)
+{
+    int i;
+    if (!prefetch_head && !format_prefetch)
+        return;
+    for (i = 0; i < PREFETCH_THREADS; i++)
+        if (pthread_create(&prefetch_threads[i], NULL, prefetch_thread, NULL))
+            break;
+    prefetch_running = i;
+}
+
+static void prefetch_finish(void)
+{
+    int i;
+    pthread_mutex_lock(&prefetch_lock);
+    prefetch_stop = 1;
+    pthread_cond_broadcast(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+    for (i = 0; i < prefetch_running; i++)
+        pthread_join(prefetch_threads[i], NULL);
+}
+#else
+static size_t prefetch_take(struct_url * url, off_t off, size_t size) { return 0; }
+static void prefetch_release(uint64_t fileid) { }
+static void format_probe(struct_file * f, const char * data, size_t len) { }
+#endif
+
+// ========== END PREFETCH ============
+
+static void usage(void)
+{
+    fprintf(stderr, "%s >>> Version: %s <<<\n", __FILE__, VERSION);
+    fprintf(stderr, "usage:  %s [-c [console]] "
+#ifdef USE_SSL
+            "[-a file] [-d n] [-5] [-2] "
+#endif
+#ifdef USE_KTLS
+            "[-K] "
+#endif
+#if defined(USE_LZ4) || defined(USE_ZSTD)
+            "[-z codec] "
+#endif
+            "[-f] [-t timeout] [-r n] [-C filename] [-S n] [-R n] [-M n] [-l file] [-D n] [-N n] [-L n] [-I name] [-B n] [-H] [-s] [-X n] [-v n] [-P file] "
+#ifdef USE_THREAD
+            "[-p file] [-F] "
+#endif
+            "url mount-parameters\n\n", argv0);
+#ifdef USE_SSL
+    fprintf(stderr, "\t -2 \tAllow RSA-MD2 server certificate\n");
+    fprintf(stderr, "\t -5 \tAllow RSA-MD5 server certificate\n");
+    fprintf(stderr, "\t -a \tCA file used to verify server certificate\n\t\t(default: %s)\n", CERT_STORE);
+#endif
+    fprintf(stderr, "\t -c \tuse console for standard input/output/error\n\t\t(default: %s)\n", CONSOLE);
+#ifdef USE_SSL
+    fprintf(stderr, "\t -d \tGNUTLS debug level (default 0)\n");
+#endif
+    fprintf(stderr, "\t -f \tstay in foreground - do not fork\n");
+#ifdef USE_KTLS
+    fprintf(stderr, "\t -K \tlet the kernel decrypt https responses (kTLS),\n\t\tTLS 1.3 sessions are not resumed\n");
+#endif
+#ifdef RETRY_ON_RESET
+    fprintf(stderr, "\t -r \tnumber of times to retry connection on reset\n\t\t(default: %i)\n", RESET_RETRIES);
+#endif
+    fprintf(stderr, "\t -t \tset socket timeout in seconds (default: %i)\n", TIMEOUT);
+    fprintf(stderr, "\t -A \tderive the receive timeout of each request from the measured\n\t\treply time and rate, at least n milliseconds and at most -t\n");
+    fprintf(stderr, "\t -C \tset cache filename. also creates .idx file near to cache file\n");
+    fprintf(stderr, "\t -S \tset max size of cache file (default: %lld)\n", CACHEMAXSIZE);
+#if defined(USE_LZ4) || defined(USE_ZSTD)
+    fprintf(stderr, "\t -z \tcompress the blocks in the cache file with "
+#ifdef USE_LZ4
+            "lz4 "
+#endif
+#ifdef USE_ZSTD
+            "zstd"
+#endif
+            "\n");
+#endif
+    fprintf(stderr, "\t -m \twhen a file changed on the server keep the cached blocks found\n\t\tin the 'offset size md5' list at its url with this suffix\n");
+    fprintf(stderr, "\t -R \tmax kernel readahead in bytes (default: as offered by kernel)\n");
+    fprintf(stderr, "\t -M \tmax size of a single read request in bytes (default: kernel default)\n");
+    fprintf(stderr, "\t -l \tmount also the urls listed in file, one 'url [name]' per line;\n\t\tthe url argument can be omitted then\n");
+    fprintf(stderr, "\tA url ending with / is mounted as a directory tree listed from the server.\n");
+    fprintf(stderr, "\t -B \tmax memory held by read buffers (default: %d)\n", POOLMAXSIZE);
+    fprintf(stderr, "\t -H \tuse huge pages for large read buffers\n");
+    fprintf(stderr, "\t -s \tsplice responses from the socket into the kernel reply\n\t\twithout copying when no cache is used\n");
+    fprintf(stderr, "\t -D \tseconds to keep directory listings (default: %i)\n", DIR_TTL);
+    fprintf(stderr, "\t -N \tseconds to keep resolved server addresses, 0 = until\n\t\tunmount (default: %i)\n", DNS_TTL);
+    fprintf(stderr, "\t -L \tseconds to send requests straight to the mirror a url was\n\t\tredirected to (default: 0, ask the master every time).\n\t\tWARNING: the data is then checked against the X-MD5 of the\n\t\tmirror instead of the master, use only with trusted mirrors\n");
+    fprintf(stderr, "\t -e \tsend a range request again on a second connection when it\n\t\twas not answered within the p95 of recent replies and at\n\t\tleast n milliseconds (default: 0, off)\n");
+    fprintf(stderr, "\t -I \tlist directories from this file in each directory instead of\n\t\tthe server autoindex, one 'name[/] [size [mtime]]' per line\n");
+    fprintf(stderr, "\t -X \ttrace the phases of the last n requests, read them from\n\t\t/%s or get them in a new %s file with SIGUSR1\n", TRACE_NAME, TRACE_FILE);
+    fprintf(stderr, "\t -P \trecord the reads to a profile file\n");
+#ifdef USE_THREAD
+    fprintf(stderr, "\t -p \tprefetch the reads recorded in a profile file at mount,\n\t\tto the cache with -C, to memory otherwise\n");
+    fprintf(stderr, "\t -F \tprefetch the metadata of squashfs and ISO9660 images\n\t\twhen the start of the image is read\n");
+    fprintf(stderr, "\t -b \tlimit the -p prefetch to n bytes per second (default: 0, no\n\t\tlimit); prefetch requests wait while reads are in flight\n");
+#endif
+    fprintf(stderr, "\t -v \tlog level 0-3: errors, warnings, info, debug (default: %i);\n\t\tSIGUSR2 steps to the next level\n", LOG_LEVEL);
+    fprintf(stderr, "\tStatistics can be read from /%s in the mount.\n", STATS_NAME);
+    fprintf(stderr, "\tmount-parameters should include the mount point\n");
+}
+
+#define shift { if(!argv[1] || !argv[2]) { usage(); return 4; };\
+    argc--; argv[1] = argv[0]; argv = argv + 1;}
+
+static int convert_num(long * num, char ** argv)
+{
+    char * end = " ";
+    if( isdigit(*(argv[1]))) {
+        *num = strtol(argv[1], &end, 0);
+        /* now end should point to '\0' */
+    }
+    if(*end){
+        usage();
+        fprintf(stderr, "'%s' is not a number.\n",
+                argv[1]);
+        return -1;
+    }
+    return 0;
+}
+
+static int convert_num64(unsigned long long * num, char ** argv)
+{
+    char * end = " ";
+    if( isdigit(*(argv[1]))) {
+        *num = strtoull(argv[1], &end, 0);
+        /* now end should point to '\0' */
+    }
+    if(*end){
+        usage();
+        fprintf(stderr, "'%s' is not a number.\n",
+                argv[1]);
+        return -1;
+    }
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char * fork_terminal = CONSOLE;
+    char * cachename = NULL;
+    char * listname = NULL;
+    char * profilename = NULL;
+#ifdef USE_THREAD
+    char * replayname = NULL;
+#endif
+    int do_fork = 1;
+    putenv("TZ=");/*UTC*/
+    argv0 = argv[0];
+    init_url(&main_url);
+    strncpy(main_url.tname, "main", TNAME_LEN);
+
+    while( argv[1] && (*(argv[1]) == '-') )
+    {
+        char * arg = argv[1]; shift;
+        while (*++arg){
+            switch (*arg){
+                case 'C': cachename = malloc(strlen(argv[1])+5); // 4 (".idx") + 1 '\0'
+                          strcpy(cachename, argv[1]);
+                          shift;
+                          break;
+                case 'S': if (convert_num64((unsigned long long*)(&cacheMaxSize), argv))
+                              return 5;
+                          shift;
+                          break;
+                case 'B': if (convert_num64((unsigned long long*)(&poolMaxSize), argv))
+                              return 5;
+                          shift;
+                          break;
+                case 'H': pool_hugepages = 1;
+                          break;
+                case 'v': {
+                              long level;
+                              if (convert_num(&level, argv))
+                                  return 4;
+                              log_level = (int)level;
+                              shift;
+                              break;
+                          }
+                case 'P': profilename = argv[1];
+                          shift;
+                          break;
+#ifdef USE_THREAD
+                case 'p': replayname = argv[1];
+                          shift;
+                          break;
+                case 'F': format_prefetch = 1;
+                          break;
+                case 'b': if (convert_num(&background_rate, argv))
+                              return 4;
+                          shift;
+                          break;
+#endif
+                case 's': splice_reads = 1;
+                          break;
+                case 'X': {
+                              long n;
+                              if (convert_num(&n, argv))
+                                  return 4;
+                              if (n <= 0 || n > TRACE_MAX) {
+                                  usage();
+                                  fprintf(stderr, "-X needs 1 to %d requests.\n", TRACE_MAX);
+                                  return 4;
+                              }
+                              trace_size = (unsigned long)n;
+                          }
+                          shift;
+                          break;
+                case 'R': if (convert_num(&max_readahead, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'M': if (convert_num(&max_read, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'l': listname = argv[1];
+                          shift;
+                          break;
+                case 'D': if (convert_num(&dir_ttl, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'N': if (convert_num(&dns_ttl, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'L': if (convert_num(&redirect_ttl, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'A': if (convert_num(&adapt_floor_ms, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'm': digest_suffix = argv[1];
+                          shift;
+                          break;
+                case 'z': if ((cache_codec = codec_find(argv[1])) < 0) {
+                              fprintf(stderr, "Codec '%s' not built in.\n", argv[1]);
+                              return 4;
+                          }
+                          shift;
+                          break;
+                case 'e': if (convert_num(&hedge_ms, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'I': dir_manifest = argv[1];
+                          shift;
+                          break;
+                case 'c': if( *(argv[1]) != '-' ) {
+                              fork_terminal = argv[1]; shift;
+                          }else{
+                              fork_terminal = 0;
+                          }
+                          break;
+#ifdef USE_SSL
+                case '2': main_url.md2 = GNUTLS_VERIFY_ALLOW_SIGN_RSA_MD2;
+                          break;
+                case '5': main_url.md5 = GNUTLS_VERIFY_ALLOW_SIGN_RSA_MD5;
+                          break;
+                case 'a': main_url.cafile = argv[1];
+                          shift;
+                          break;
+#ifdef USE_KTLS
+                case 'K': use_ktls = 1;
+                          break;
+#endif
+                case 'd': if (convert_num(&main_url.ssl_log_level, argv))
+                              return 4;
+                          shift;
+                          break;
+#endif
+#ifdef RETRY_ON_RESET
+                case 'r': if (convert_num(&main_url.retry_reset, argv))
+                              return 4;
+                          shift;
+                          break;
+#endif
+                case 't': if (convert_num(&main_url.timeout, argv))
+                              return 4;
+                          shift;
+                          break;
+                case 'f': do_fork = 0;
+                          break;
+                default:
+                          usage();
+                          fprintf(stderr, "Unknown option '%c'.\n", *arg);
+                          return 4;
+            }
+        }
+    }
+
+    /* a mount point can contain "://" too, only known schemes are urls */
+    int have_url = argv[1] && (!strncmp(argv[1], "http://", 7) || !strncmp(argv[1], "https://", 8));
+    if (argc < (have_url ? 3 : 2) || (!have_url && !listname)) {
+        usage();
+        return 1;
+    }
+    if (cachename) {
+        if (init_cache(cachename) != 0){
+            fprintf(stderr, "err cache init\n");
+             return 5;
+        }
+        free(cachename);
+    }
+    if (have_url) {
+        if(parse_url(argv[1], &main_url, URL_DUP) == -1){
+            fprintf(stderr, "invalid url: %s\n", argv[1]);
+            return 2;
+        }
+        if (argv[1][strlen(argv[1]) - 1] == '/') /* mount the directory tree */
+            root_node.location = strdup(argv[1]);
+        else if (!add_file(argv[1], NULL, &main_url))
+            return 2;
+    }
+    if (listname && load_file_list(listname))
+        return 2;
+    if (!files_count && !root_node.location) {
+        usage();
+        return 1;
+    }
+    if (!have_url && parse_url(files[0]->url ? files[0]->url->url : files[0]->location,
+                &main_url, URL_DUP) == -1)
+        return 2;
+    print_url(L_INFO, &main_url);
+    int sockfd = open_client_socket(&main_url);
+    if(sockfd < 0) {
+        fprintf(stderr, "Connection failed.\n");
+        return 3;
+    }
+#ifdef USE_SSL
+    else {
+        print_ssl_info(main_url.ss);
+    }
+#endif
+    close_client_socket(&main_url);
+    if (main_url.ino) {
+        struct stat st;
+        off_t size = get_stat(&main_url, &st);
+        if(size >= 0) {
+            fprintf(stderr, "file size: \t%" PRIdMAX "\n", (intmax_t)size);
+        }else{
+            return 3;
+        }
+    }
+    if (root_node.location)
+        fprintf(stderr, "directory tree: \t%s\n", root_node.location);
+    fprintf(stderr, "files mounted: \t%zu\n", files_count);
+    if (node_child(&root_node, STATS_NAME))
+        fprintf(stderr, "%s: %s is a mounted file, statistics not available.\n", argv0, STATS_NAME);
+    else
+        node_add(&root_node, STATS_NAME, NULL, NULL)->content = stats_content;
+    if (trace_size > 0 && !node_child(&root_node, TRACE_NAME)) {
+        struct sigaction sa;
+        if (!(trace_ring = calloc(trace_size, sizeof(struct_trace_event)))) {
+            fprintf(stderr, "%s: no memory for %lu trace events.\n", argv0, trace_size);
+            return 1;
+        }
+        node_add(&root_node, TRACE_NAME, NULL, NULL)->content = trace_content;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = trace_signal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR1, &sa, NULL);
+    }
+    {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = log_signal;
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &sa, NULL);
+    }
+
+#ifdef USE_THREAD
+    if (replayname && prefetch_load(replayname))
+        return 2;
+#endif
+    if (profilename && !(profile_out = fopen(profilename, "w"))) {
+        fprintf(stderr, "Can't create profile %s: %s\n", profilename, strerror(errno));
+        return 2;
+    }
+
+    if (have_url) shift;
     if(fork_terminal && access(fork_terminal, O_RDWR)){
         errno_report(fork_terminal);
         fork_terminal=0;
@@ -1315,8 +4513,9 @@ int main(int argc, char *argv[])
 
 #ifdef USE_THREAD
     close_client_force(&main_url); /* each thread should open its own socket */
-    pthread_key_create(&url_key, &destroy_url_copy);
+    pthread_key_create(&url_key, &destroy_thread_urls);
     pthread_mutex_init(&cache_lock, NULL);
+    pthread_mutex_init(&files_lock, NULL);
 #endif
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fuse_chan *ch;
@@ -1329,6 +4528,12 @@ int main(int argc, char *argv[])
     // is mounted using httpfs. Proper end of the process is umount, not kill.
     argv[0][0] = '@';
 
+    if (max_read > 0) {
+        char opt[32];
+        snprintf(opt, sizeof(opt), "-omax_read=%ld", max_read);
+        fuse_opt_add_arg(&args, opt);
+    }
+
     if (fuse_parse_cmdline(&args, &mountpoint, NULL, NULL) != -1 &&
             (ch = fuse_mount(mountpoint, &args)) != NULL) {
         /* try to fork at some point where the setup is mostly done */
@@ -1353,6 +4558,13 @@ int main(int argc, char *argv[])
                     }
 
                     struct fuse_session *se;
+                    log_start(); /* threads do not survive the fork */
+                    profile_start = now_us();
+#ifdef USE_THREAD
+                    prefetch_start();
+                    inval_start();
+#endif
+                    fuse_ch = ch;
                     se = fuse_lowlevel_new(&args, &httpfs_oper,
                             sizeof(httpfs_oper), NULL);
                     if (se != NULL) {
@@ -1365,6 +4577,13 @@ int main(int argc, char *argv[])
                         fuse_session_destroy(se);
                     }
                     fuse_unmount(mountpoint, ch);
+#ifdef USE_THREAD
+                    inval_finish();
+                    prefetch_finish();
+#endif
+                    if (profile_out)
+                        fclose(profile_out);
+                    log_finish();
                 }
                 break;;
             case -1:
@@ -1379,6 +4598,7 @@ int main(int argc, char *argv[])
 
 #ifdef USE_THREAD
     pthread_mutex_destroy(&cache_lock);
+    pthread_mutex_destroy(&files_lock);
 #endif
     if (fdcache > 0) {
         close(fdcache);
@@ -1403,7 +4623,7 @@ int handle_ssl_error(struct_url *url, ssize_t * res, const char *where)
         return 0;
 
     if (*res == GNUTLS_E_REHANDSHAKE) {
-        fprintf(stderr, "%s: %s: %s: %zd %s.\n", argv0, url->tname, where, *res,
+        log_msg(L_WARN, "%s: %s: %s: %zd %s.\n", argv0, url->tname, where, *res,
                 "SSL rehanshake requested by server");
         if (gnutls_safe_renegotiation_status(url->ss)) {
             *res = gnutls_handshake (url->ss);
@@ -1412,7 +4632,7 @@ int handle_ssl_error(struct_url *url, ssize_t * res, const char *where)
             }
             return 1;
         } else {
-            fprintf(stderr, "%s: %s: %s: %zd %s.\n", argv0, url->tname, where, *res,
+            log_msg(L_WARN, "%s: %s: %s: %zd %s.\n", argv0, url->tname, where, *res,
                     "safe rehandshake not supported on this connection");
             return 0;
         }
@@ -1436,7 +4656,7 @@ int handle_ssl_error(struct_url *url, ssize_t * res, const char *where)
 
 static int close_client_socket(struct_url *url) {
     if (url->sock_type == SOCK_KEEPALIVE) {
-        fprintf(stderr, "%s: %s: keeping socket open.\n", argv0, url->tname); /*DEBUG*/
+        log_msg(L_DEBUG, "%s: %s: keeping socket open.\n", argv0, url->tname);
         return SOCK_KEEPALIVE;
     }
     return close_client_force(url);
@@ -1446,11 +4666,14 @@ static int close_client_force(struct_url *url) {
     int sock_closed = 0;
 
     if(url->sock_type != SOCK_CLOSED){
-        fprintf(stderr, "%s: %s: closing socket.\n", argv0, url->tname); /*DEBUG*/
+        log_msg(L_DEBUG, "%s: %s: closing socket.\n", argv0, url->tname);
 #ifdef USE_SSL
         if (url->proto == PROTO_HTTPS) {
-            fprintf(stderr, "%s: %s: closing SSL socket.\n", argv0, url->tname);
-            gnutls_bye(url->ss, GNUTLS_SHUT_RDWR);
+            log_msg(L_DEBUG, "%s: %s: closing SSL socket.\n", argv0, url->tname);
+            ssl_session_save(url);
+            /* with kTLS gnutls can no longer read the close alert */
+            gnutls_bye(url->ss, url->ktls ? GNUTLS_SHUT_WR : GNUTLS_SHUT_RDWR);
+            url->ktls = 0;
             gnutls_deinit(url->ss);
         }
 #endif
@@ -1459,13 +4682,13 @@ static int close_client_force(struct_url *url) {
     }
     url->sock_type = SOCK_CLOSED;
 
-    if(url->redirected && url->redirect_followed) {
-        fprintf(stderr, "%s: %s: returning from redirect to master %s\n", argv0, url->tname, url->url);
+    if(url->redirected && url->redirect_followed && !url->redirect_cached) {
+        log_msg(L_DEBUG, "%s: %s: returning from redirect to master %s\n", argv0, url->tname, url->url);
         if (sock_closed) url->redirect_depth = 0;
         url->redirect_followed = 0;
         url->redirected = 0;
         parse_url(NULL, url, URL_DROP);
-        print_url(stderr, url);
+        print_url(L_DEBUG, url);
         return -EAGAIN;
     }
     return url->sock_type;
@@ -1473,19 +4696,46 @@ static int close_client_force(struct_url *url) {
 
 #ifdef USE_THREAD
 
+/* The copies of the file urls made by one thread, indexed like files[] */
+typedef struct thread_urls {
+    struct_url ** urls;
+    size_t count;
+    struct_url * current;
+    struct_url * base; /* copy of main_url for threads not reading a file yet */
+    struct_stats * stats;
+    struct_pipes pipes;
+} struct_thread_urls;
+
 static void destroy_url_copy(void * urlptr)
 {
     if(urlptr){
-        fprintf(stderr, "%s: Thread %08lX ended.\n", argv0, pthread_self()); /*DEBUG*/
         free_url(urlptr);
         free(urlptr);
     }
 }
 
+static void destroy_thread_urls(void * ptr)
+{
+    struct_thread_urls * t = ptr;
+    size_t i;
+    if(t){
+        log_msg(L_DEBUG, "%s: Thread %08lX ended.\n", argv0, pthread_self());
+        for (i = 0; i < t->count; i++)
+            destroy_url_copy(t->urls[i]);
+        destroy_url_copy(t->base);
+        splice_close(&t->pipes);
+        stats_retire(t->stats);
+        free(t->urls);
+        free(t);
+    }
+}
+
 static struct_url * create_url_copy(const struct_url * url)
 {
     struct_url * res = malloc(sizeof(struct_url));
     memcpy(res, url, sizeof(struct_url));
+    if(url->url)
+        res->url = strdup(url->url);
     if(url->name)
         res->name = strdup(url->name);
     if(url->host)
@@ -1501,34 +4751,145 @@ static struct_url * create_url_copy(const struct_url * url)
     return res;
 }
 
-static struct_url * thread_setup(void)
+static struct_thread_urls * thread_urls_get(void)
+{
+    struct_thread_urls * t = pthread_getspecific(url_key);
+    if(!t) {
+        log_msg(L_DEBUG, "%s: Thread %08lX started.\n", argv0, pthread_self());
+        t = calloc(1, sizeof(struct_thread_urls));
+        t->stats = stats_new();
+        pthread_setspecific(url_key, t);
+    }
+    return t;
+}
+
+static struct_url * url_setup(struct_file * f)
+{
+    struct_thread_urls * t = thread_urls_get();
+    size_t idx = INO_FILE(f->ino);
+    if(idx >= t->count) {
+        t->urls = realloc(t->urls, (idx + 1) * sizeof(struct_url *));
+        memset(t->urls + t->count, 0, (idx + 1 - t->count) * sizeof(struct_url *));
+        t->count = idx + 1;
+    }
+    if(!t->urls[idx]) {
+        t->urls[idx] = create_url_copy(f->url);
+        t->urls[idx]->stats = t->stats;
+    }
+    return t->current = t->urls[idx];
+}
+
+static struct_pipes * thread_pipes(void)
+{
+    return &thread_urls_get()->pipes;
+}
+
+/* The url the thread works on currently */
+static struct_url * thread_setup(void)
+{
+    struct_thread_urls * t = thread_urls_get();
+    if(t->current)
+        return t->current;
+    if(!t->base) {
+        t->base = create_url_copy(&main_url);
+        t->base->stats = t->stats;
+    }
+    return t->base;
+}
+
+static struct_url ** thread_urls(size_t * count)
+{
+    struct_thread_urls * t = pthread_getspecific(url_key);
+    *count = t ? t->count : 0;
+    return t ? t->urls : NULL;
+}
+
+#else /*USE_THREAD*/
+static struct_url * url_setup(struct_file * f) { return f->url; }
+static struct_url * thread_setup(void) { return &main_url; }
+
+static struct_pipes * thread_pipes(void)
+{
+    static struct_pipes pipes;
+    return &pipes;
+}
+
+static struct_url ** thread_urls(size_t * count)
+{
+    static struct_url ** urls = NULL;
+    static size_t urls_count = 0;
+    size_t i;
+    if (urls_count != files_count) {
+        urls = realloc(urls, files_count * sizeof(struct_url *));
+        for (i = 0; i < files_count; i++)
+            urls[i] = files[i]->url;
+        urls_count = files_count;
+    }
+    *count = urls_count;
+    return urls;
+}
+#endif
+
+/*
+ * Sockets belong to the struct_url of one file. Take over an idle
+ * keepalive socket to the same server left open by another file of this
+ * thread rather than connecting again.
+ */
+
+static int adopt_keepalive_socket(struct_url *url)
 {
-    struct_url * res = pthread_getspecific(url_key);
-    if(!res) {
-        fprintf(stderr, "%s: Thread %08lX started.\n", argv0, pthread_self()); /*DEBUG*/
-        res = create_url_copy(&main_url);
-        pthread_setspecific(url_key, res);
-    }
-    return res;
-}
+    size_t i, count;
+    struct_url ** urls = thread_urls(&count);
 
-#else /*USE_THREAD*/
-static struct_url * thread_setup(void) { return &main_url; }
+    if (url->redirected || url->own_socket)
+        return 0;
+    for (i = 0; i < count; i++) {
+        struct_url * o = urls[i];
+        if (!o || o == url || o->sock_type != SOCK_KEEPALIVE
+                || o->proto != url->proto || o->port != url->port
+                || strcmp(o->host, url->host))
+            continue;
+        url->sockfd = o->sockfd;
+        url->sock_type = SOCK_KEEPALIVE;
+        url->io_timeout = o->io_timeout;
+#ifdef USE_SSL
+        if (url->proto == PROTO_HTTPS) {
+            url->ss = o->ss;
+            gnutls_session_set_ptr(url->ss, url);
+            url->ssl_connected = 1;
+            url->ktls = o->ktls;
+            o->ktls = 0;
+        }
 #endif
+        o->sock_type = SOCK_CLOSED;
+        log_msg(L_DEBUG, "%s: %s: reusing keepalive socket of %s.\n", argv0, url->tname, o->name);
+        return 1;
+    }
+    return 0;
+}
 
 
 static ssize_t read_client_socket(struct_url *url, void * buf, size_t len) {
     ssize_t res;
-    struct timeval timeout;
-    timeout.tv_sec = url->timeout;
-    timeout.tv_usec = 0;
-    setsockopt(url->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#ifdef USE_KTLS
+    if (url->ktls) {
+        res = ktls_read(url, buf, len);
+        if (res <= 0) errno_report("read");
+    } else
+#endif
 #ifdef USE_SSL
     if (url->proto == PROTO_HTTPS) {
+        uint64_t start = now_us();
         do {
             res = gnutls_record_recv(url->ss, buf, len);
-        } while ((res < 0) && handle_ssl_error(url, &res, "read"));
+            /* A TLS 1.3 session ticket received after the handshake is
+             * reported as GNUTLS_E_AGAIN. Only the receive timeout takes
+             * the full timeout. */
+        } while ((res < 0) && ((res == GNUTLS_E_AGAIN && now_us() - start < url->io_timeout)
+                    || handle_ssl_error(url, &res, "read")));
         if (res <= 0) ssl_error(res, url, "read");
+        /* a receive timeout, like on a plain socket */
+        if (res == GNUTLS_E_AGAIN) errno = EAGAIN;
     } else
 #endif
     {
@@ -1566,122 +4927,409 @@ write_client_socket(struct_url *url, const void * buf, size_t len)
     return -1; /*should not reach*/
 }
 
+// ========== ADAPTIVE TIMEOUT ============
 /*
- * Function yields either a positive int after connecting to
- * host 'hostname' on port 'port'  or < 0 in case of error
- *
- * It handles keepalive by not touching keepalive sockets.
- * The SSL context is created so that read/write can use it.
- *
- * hostname is something like 'www.tmtd.de' or 192.168.0.86
- * port is expected in machine order (not net order)
- *
- * ((Flonix  defines USE_IPV6))
- *
+ * With -A the receive timeout of a request is ADAPT_MULT times the time
+ * it is expected to take: the smoothed time to first byte of the url plus
+ * the size at the smoothed body rate, but at least the -A milliseconds
+ * and at most the -t timeout. Until a url has a first sample the -t
+ * timeout is used. A request that times out doubles the estimates, so a
+ * slow server is retried with longer timeouts up to -t.
  */
-#if defined(AF_INET6) && defined(IN6_IS_ADDR_V4MAPPED)
-#define USE_IPV6
-#endif
+#define ADAPT_MULT 4
 
-static int open_client_socket(struct_url *url) {
-#ifdef USE_IPV6
-    struct addrinfo hints;
-    char portstr[10];
-    int gaierr;
-    struct addrinfo* ai;
-    struct addrinfo* aiv4;
-    struct addrinfo* aiv6 = 0;
-    struct sockaddr_in6 sa;
-#else /* USE_IPV6 */
-    struct hostent *he;
-    struct sockaddr_in sa;
-#endif /* USE_IPV6 */
-    socklen_t sa_len;
-    int sock_family, sock_type, sock_protocol;
+static void set_io_timeout(struct_url * url, uint64_t us)
+{
+    struct timeval timeout;
 
-    if(url->sock_type == SOCK_KEEPALIVE) {
-        fprintf(stderr, "%s: %s: reusing keepalive socket.\n", argv0, url->tname); /*DEBUG*/
-        return url->sock_type;
+    timeout.tv_sec = (time_t)(us / 1000000);
+    timeout.tv_usec = (suseconds_t)(us % 1000000);
+    setsockopt(url->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    url->io_timeout = us;
+}
+
+/* Set the timeout for a request of size bytes on the open socket */
+static void adapt_timeout(struct_url * url, size_t size)
+{
+    uint64_t us = (uint64_t)url->timeout * 1000000;
+
+    if (!adapt_floor_ms || url->sock_type == SOCK_CLOSED)
+        return;
+    if (url->rtt) {
+        uint64_t expected = url->rtt;
+        if (url->rate)
+            expected += (uint64_t)size * 1000000 / url->rate;
+        if (expected * ADAPT_MULT < us)
+            us = expected * ADAPT_MULT;
+        if (us < (uint64_t)adapt_floor_ms * 1000)
+            us = (uint64_t)adapt_floor_ms * 1000;
     }
+    if (us != url->io_timeout)
+        set_io_timeout(url, us);
+}
 
-    if(url->sock_type != SOCK_CLOSED) close_client_socket(url);
+static void adapt_rtt(struct_url * url, uint64_t us)
+{
+    url->rtt = url->rtt ? (url->rtt * 7 + us) / 8 : us;
+}
 
-    if (url->redirected)
-        url->redirect_followed = 1;
+/* Bodies too small to be dominated by the transfer are not sampled */
+static void adapt_rate(struct_url * url, size_t bytes, uint64_t us)
+{
+    uint64_t rate;
+
+    if (bytes < 65536 || !us)
+        return;
+    rate = (uint64_t)bytes * 1000000 / us;
+    url->rate = url->rate ? (url->rate * 7 + rate) / 8 : rate;
+}
 
-    fprintf(stderr, "%s: %s: connecting to %s port %i.\n", argv0, url->tname, url->host, url->port);
+/*
+ * The request timed out with an adaptive timeout. Returns 1 when it is
+ * worth retrying because the next timeout is longer.
+ */
+static int adapt_expired(struct_url * url)
+{
+    if (!adapt_floor_ms || errno != EAGAIN
+            || url->io_timeout >= (uint64_t)url->timeout * 1000000)
+        return 0;
+    log_msg(L_DEBUG, "%s: %s: no data within %" PRIu64 " ms.\n", argv0, url->tname, url->io_timeout / 1000);
+    url->rtt *= 2;
+    url->rate /= 2;
+    return 1;
+}
+
+// ========== END ADAPTIVE TIMEOUT ============
+
+#if defined(AF_INET6) && defined(IN6_IS_ADDR_V4MAPPED)
+#define USE_IPV6
+#endif
+
+/*
+ * Resolved addresses are kept for dns_ttl seconds (-N, 0 = for good) and
+ * resolved again by the first connect after that; when the resolver
+ * fails the old addresses stay in use. So connects, also to the mirrors
+ * of redirects, normally do not call the resolver.
+ *
+ * Each address counts its failed connects. dns_connect() tries the
+ * addresses with fewest failures first, alternating IPv6 and IPv4, and
+ * starts the next attempt whenever the previous ones have not connected
+ * within DNS_RACE_MS ("Happy Eyeballs"); the first to connect is used.
+ */
+#define DNS_ADDRS 8
+#define DNS_RACE_MS 250
+
+typedef struct {
+    struct sockaddr_storage sa;
+    socklen_t len;
+    unsigned fails;
+} struct_dns_addr;
 
-    (void) memset((void*) &sa, 0, sizeof(sa));
+typedef struct dns_entry {
+    char * host;
+    int port;
+    time_t resolved;
+    int count;
+    struct_dns_addr addrs[DNS_ADDRS];
+    struct dns_entry * next;
+} struct_dns_entry;
+
+static struct_dns_entry * dns_cache = NULL;
+#ifdef USE_THREAD
+pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
+static int dns_resolve(struct_url * url, struct_dns_addr * addrs)
+{
+    int count = 0;
 #ifdef USE_IPV6
+    struct addrinfo hints;
+    struct addrinfo * ai, * a;
+    char portstr[10];
+    int gaierr;
+
     (void) memset(&hints, 0, sizeof(hints));
     hints.ai_family = PF_UNSPEC;
     hints.ai_socktype = SOCK_STREAM;
     (void) snprintf(portstr, sizeof(portstr), "%d", (int) url->port);
     if ((gaierr = getaddrinfo(url->host, portstr, &hints, &ai)) != 0) {
-        (void) fprintf(stderr, "%s: %s: getaddrinfo %s - %s\n",
+        log_msg(L_ERROR, "%s: %s: getaddrinfo %s - %s\n",
                 argv0, url->tname, url->host, gai_strerror(gaierr));
-        errno = EIO;
         return -1;
     }
+    for (a = ai; a && count < DNS_ADDRS; a = a->ai_next) {
+        if ((a->ai_family != AF_INET && a->ai_family != AF_INET6)
+                || a->ai_addrlen > sizeof(addrs[count].sa))
+            continue;
+        memset(&addrs[count], 0, sizeof(addrs[count]));
+        memcpy(&addrs[count].sa, a->ai_addr, a->ai_addrlen);
+        addrs[count++].len = a->ai_addrlen;
+    }
+    freeaddrinfo(ai);
+#else /* USE_IPV6 */
+    struct hostent *he;
+    char ** p;
+
+    he = gethostbyname(url->host);
+    if (he == NULL) {
+        log_msg(L_ERROR, "%s: %s: unknown host - %s\n", argv0, url->tname, url->host);
+        return -1;
+    }
+    for (p = he->h_addr_list; *p && count < DNS_ADDRS; p++) {
+        struct sockaddr_in * sa = (struct sockaddr_in *)&addrs[count].sa;
+        memset(&addrs[count], 0, sizeof(addrs[count]));
+        sa->sin_family = AF_INET;
+        sa->sin_port = htons(url->port);
+        (void) memmove(&sa->sin_addr, *p, sizeof(sa->sin_addr));
+        addrs[count++].len = sizeof(*sa);
+    }
+#endif /* USE_IPV6 */
+    if (!count)
+        log_msg(L_ERROR, "%s: %s: no valid address found for host %s\n",
+                argv0, url->tname, url->host);
+    return count;
+}
 
-    /* Find the first IPv4 and IPv6 entries. */
-    for (aiv4 = ai; aiv4 != NULL; aiv4 = aiv4->ai_next) {
-        if (aiv4->ai_family == AF_INET)
+/* The addresses of the url host, resolved if not cached or too old */
+static int dns_lookup(struct_url * url, struct_dns_addr * addrs)
+{
+    struct_dns_entry * e;
+    struct_dns_addr fresh[DNS_ADDRS];
+    int count, i, j;
+    uint64_t t;
+
+#ifdef USE_THREAD
+    pthread_mutex_lock(&dns_lock);
+#endif
+    for (e = dns_cache; e; e = e->next)
+        if (e->port == url->port && !strcmp(e->host, url->host))
             break;
-        if ((aiv4->ai_family == AF_INET6) && (aiv6 == NULL))
-            aiv6 = aiv4;
+    if (e && (!dns_ttl || time(NULL) - e->resolved < dns_ttl)) {
+        count = e->count;
+        memcpy(addrs, e->addrs, (size_t)count * sizeof(struct_dns_addr));
+#ifdef USE_THREAD
+        pthread_mutex_unlock(&dns_lock);
+#endif
+        return count;
     }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&dns_lock);
+#endif
 
-    /* If there's an IPv4 address, use that, otherwise try IPv6. */
-    if (aiv4 == NULL)
-        aiv4 = aiv6;
-    if (aiv4 == NULL) {
-        (void) fprintf(stderr, "%s: %s: no valid address found for host %s\n",
+    t = trace_now();
+    count = dns_resolve(url, fresh);
+    STAT_ADD(url, ST_DNS_LOOKUPS, 1);
+    trace(TR_DNS, url, t, 0, 0, 0);
+
+#ifdef USE_THREAD
+    pthread_mutex_lock(&dns_lock);
+#endif
+    if (!e) {
+        for (e = dns_cache; e; e = e->next)
+            if (e->port == url->port && !strcmp(e->host, url->host))
+                break;
+    }
+    if (count > 0) {
+        if (!e) {
+            e = calloc(1, sizeof(struct_dns_entry));
+            e->host = strdup(url->host);
+            e->port = url->port;
+            e->next = dns_cache;
+            dns_cache = e;
+        }
+        /* addresses still returned keep their failure counts */
+        for (i = 0; i < count; i++)
+            for (j = 0; j < e->count; j++)
+                if (fresh[i].len == e->addrs[j].len && !memcmp(&fresh[i].sa, &e->addrs[j].sa, fresh[i].len))
+                    fresh[i].fails = e->addrs[j].fails;
+        memcpy(e->addrs, fresh, (size_t)count * sizeof(struct_dns_addr));
+        e->count = count;
+        e->resolved = time(NULL);
+    } else if (e && e->count) {
+        log_msg(L_WARN, "%s: %s: using the addresses of %s resolved before\n",
                 argv0, url->tname, url->host);
-        errno = EIO;
-        return -1;
+        e->resolved = time(NULL);
     }
-    if (sizeof(sa) < aiv4->ai_addrlen) {
-        (void) fprintf(stderr, "%s: %s: %s - sockaddr too small (%lu < %lu)\n",
-                argv0, url->tname, url->host, (unsigned long) sizeof(sa),
-                (unsigned long) aiv4->ai_addrlen);
+    count = e ? e->count : 0;
+    if (e)
+        memcpy(addrs, e->addrs, (size_t)count * sizeof(struct_dns_addr));
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&dns_lock);
+#endif
+    if (count <= 0)
         errno = EIO;
+    return count;
+}
+
+static void dns_health(struct_url * url, const struct_dns_addr * a, int ok)
+{
+    struct_dns_entry * e;
+    int i;
+
+#ifdef USE_THREAD
+    pthread_mutex_lock(&dns_lock);
+#endif
+    for (e = dns_cache; e; e = e->next)
+        if (e->port == url->port && !strcmp(e->host, url->host))
+            break;
+    for (i = 0; e && i < e->count; i++)
+        if (e->addrs[i].len == a->len && !memcmp(&e->addrs[i].sa, &a->sa, a->len))
+            e->addrs[i].fails = ok ? 0 : e->addrs[i].fails + 1;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&dns_lock);
+#endif
+}
+
+/* Order of the connect attempts, see above */
+static void dns_order(const struct_dns_addr * addrs, int count, int * order)
+{
+    int family[2][DNS_ADDRS], n[2] = { 0, 0 }, i, j, k, f;
+
+    for (i = 0; i < count; i++) {
+        f = addrs[i].sa.ss_family == AF_INET;
+        /* insertion keeping the resolver order among equal failure counts */
+        for (j = n[f]; j > 0 && addrs[family[f][j - 1]].fails > addrs[i].fails; j--)
+            family[f][j] = family[f][j - 1];
+        family[f][j] = i;
+        n[f]++;
+    }
+    /* start with the family of the best address */
+    f = !n[0] || (n[1] && addrs[family[1][0]].fails < addrs[family[0][0]].fails);
+    for (k = 0, i = 0, j = 0; k < count; k++) {
+        if ((f ? j : i) >= n[f])
+            f = !f;
+        order[k] = f ? family[1][j++] : family[0][i++];
+        f = !f;
+    }
+}
+
+static int dns_connect(struct_url * url, struct_dns_addr * addrs, int count)
+{
+    struct pollfd pfd[DNS_ADDRS];
+    int which[DNS_ADDRS], order[DNS_ADDRS];
+    int started = 0, active = 0, fd = -1, err = ECONNREFUSED, i;
+    uint64_t now = now_us(), next = now, deadline = now + (uint64_t)url->timeout * 1000000;
+
+    dns_order(addrs, count, order);
+    while (fd < 0) {
+        now = now_us();
+        if (started < count && (!active || now >= next)) {
+            struct_dns_addr * a = &addrs[order[started++]];
+            int s = socket(a->sa.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+            if (s < 0) {
+                err = errno;
+                continue;
+            }
+            if (!connect(s, (struct sockaddr *)&a->sa, a->len)) {
+                fd = s;
+                dns_health(url, a, 1);
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                err = errno;
+                close(s);
+                dns_health(url, a, 0);
+                continue;
+            }
+            pfd[active].fd = s;
+            pfd[active].events = POLLOUT;
+            which[active++] = order[started - 1];
+            next = now + DNS_RACE_MS * 1000;
+            continue;
+        }
+        if (!active)
+            break;
+        if (now >= deadline) {
+            err = ETIMEDOUT;
+            break;
+        }
+        i = poll(pfd, (nfds_t)active, (int)(((started < count && next < deadline ? next : deadline) - now + 999) / 1000));
+        if (i < 0 && errno != EINTR) {
+            err = errno;
+            break;
+        }
+        for (i = 0; i < active; i++) {
+            int e = 0;
+            socklen_t elen = sizeof(e);
+            if (!pfd[i].revents)
+                continue;
+            if (getsockopt(pfd[i].fd, SOL_SOCKET, SO_ERROR, &e, &elen) < 0)
+                e = errno;
+            if (!e) {
+                fd = pfd[i].fd;
+                dns_health(url, &addrs[which[i]], 1);
+                pfd[i] = pfd[--active];
+                which[i] = which[active];
+                break;
+            }
+            err = e;
+            close(pfd[i].fd);
+            dns_health(url, &addrs[which[i]], 0);
+            pfd[i] = pfd[--active];
+            which[i] = which[active];
+            i--;
+        }
+    }
+    /* attempts still in progress lost the race */
+    for (i = 0; i < active; i++)
+        close(pfd[i].fd);
+    if (fd < 0) {
+        errno = err;
         return -1;
     }
-    sock_family = aiv4->ai_family;
-    sock_type = aiv4->ai_socktype;
-    sock_protocol = aiv4->ai_protocol;
-    sa_len = aiv4->ai_addrlen;
-    (void) memmove(&sa, aiv4->ai_addr, sa_len);
-    freeaddrinfo(ai);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+    return fd;
+}
 
-#else /* USE_IPV6 */
+/*
+ * Function yields either a positive int after connecting to
+ * host 'hostname' on port 'port'  or < 0 in case of error
+ *
+ * It handles keepalive by not touching keepalive sockets.
+ * The SSL context is created so that read/write can use it.
+ *
+ * hostname is something like 'www.tmtd.de' or 192.168.0.86
+ * port is expected in machine order (not net order)
+ *
+ * ((Flonix  defines USE_IPV6))
+ *
+ */
 
-    he = gethostbyname(url->host);
-    if (he == NULL) {
-        (void) fprintf(stderr, "%s: %s: unknown host - %s\n", argv0, url->tname, url->host);
-        errno = EIO;
-        return -1;
+static int open_client_socket(struct_url *url) {
+    struct_dns_addr addrs[DNS_ADDRS];
+    int count;
+    uint64_t t;
+
+    if(url->sock_type == SOCK_KEEPALIVE) {
+        log_msg(L_DEBUG, "%s: %s: reusing keepalive socket.\n", argv0, url->tname);
+        STAT_ADD(url, ST_KEEPALIVE_REUSE, 1);
+        return url->sock_type;
+    }
+    if(url->sock_type == SOCK_CLOSED && adopt_keepalive_socket(url)) {
+        STAT_ADD(url, ST_KEEPALIVE_REUSE, 1);
+        return url->sock_type;
     }
-    sock_family = sa.sin_family = he->h_addrtype;
-    sock_type = SOCK_STREAM;
-    sock_protocol = 0;
-    sa_len = sizeof(sa);
-    (void) memmove(&sa.sin_addr, he->h_addr, he->h_length);
-    sa.sin_port = htons(url->port);
 
-#endif /* USE_IPV6 */
+    if(url->sock_type != SOCK_CLOSED) close_client_socket(url);
 
-    url->sockfd = socket(sock_family, sock_type, sock_protocol);
-    if (url->sockfd < 0) {
-        errno_report("couldn't get socket");
+    if (url->redirected)
+        url->redirect_followed = 1;
+
+    log_msg(L_DEBUG, "%s: %s: connecting to %s port %i.\n", argv0, url->tname, url->host, url->port);
+
+    if ((count = dns_lookup(url, addrs)) <= 0)
         return -1;
-    }
-    if (connect(url->sockfd, (struct sockaddr*) &sa, sa_len) < 0) {
+
+    t = trace_now();
+    url->sockfd = dns_connect(url, addrs, count);
+    if (url->sockfd < 0) {
         errno_report("couldn't connect socket");
         return -1;
     }
+    STAT_ADD(url, ST_CONNECTS, 1);
+    trace(TR_CONNECT, url, t, 0, 0, 0);
+    /* set here rather than before every read, -A changes it per request */
+    set_io_timeout(url, (uint64_t)url->timeout * 1000000);
 
 #ifdef USE_SSL
     if ((url->proto) == PROTO_HTTPS) {
@@ -1689,55 +5337,183 @@ static int open_client_socket(struct_url *url) {
         ssize_t r = 0;
         const char * ps = "NORMAL"; /* FIXME allow user setting */
         const char * errp = NULL;
-        if (!url->ssl_initialized) {
-            r = gnutls_global_init();
-            if (!r)
-                r = gnutls_certificate_allocate_credentials (&url->sc); /* docs suggest to share creds */
-            if (url->cafile) {
-                if (!r)
-                    r = gnutls_certificate_set_x509_trust_file (url->sc, url->cafile, GNUTLS_X509_FMT_PEM);
-                if (r>0)
-                    fprintf(stderr, "%s: SSL init: loaded %zi CA certificate(s).\n", argv0, r);
-                if (r>0) r = 0;
-            }
-            if (!r)
-                gnutls_certificate_set_verify_function (url->sc, verify_certificate_callback);
-            gnutls_certificate_set_verify_flags (url->sc, GNUTLS_VERIFY_ALLOW_X509_V1_CA_CRT /* suggested */
-                    | url->md5 | url->md2 ); /* oprional for old cert compat */
-            if (!r) url->ssl_initialized = 1;
-            gnutls_global_set_log_level((int)url->ssl_log_level);
-            gnutls_global_set_log_function(&logfunc);
-        }
+        r = ssl_init(url);
         if (r) {
             ssl_error(r, url, "SSL init");
             return -1;
         }
 
-        fprintf(stderr, "%s: %s: initializing SSL socket.\n", argv0, url->tname);
-        r = gnutls_init(&url->ss, GNUTLS_CLIENT);
-        if (!r) gnutls_session_set_ptr(url->ss, url); /* used in cert verifier */
-        if (!r) gnutls_server_name_set(url->ss, GNUTLS_NAME_DNS, url->host, strlen(url->host));
-        if (!r) r = gnutls_priority_set_direct(url->ss, ps, &errp);
-        if (!r) errp = NULL;
-        /* alternative to gnutls_priority_set_direct: if (!r) gnutls_set_default_priority(url->ss); */
-        if (!r) r = gnutls_credentials_set(url->ss, GNUTLS_CRD_CERTIFICATE, url->sc);
-        if (!r) gnutls_transport_set_ptr(url->ss, (gnutls_transport_ptr_t) (intptr_t) url->sockfd);
-        if (!r) r = gnutls_handshake (url->ss);
-        do ; while ((r) && handle_ssl_error(url, &r, "opening SSL socket"));
-        if (r) {
-            close(url->sockfd);
-            if (errp) fprintf(stderr, "%s: invalid SSL priority\n %s\n %*s\n", argv0, ps, (int)(errp - ps), "^");
-            fprintf(stderr, "%s: %s:%d - ", argv0, url->host, url->port);
-            ssl_error(r, url, "SSL connection failed");
-            fprintf(stderr, "%s: %s: closing SSL socket.\n", argv0, url->tname);
-            gnutls_deinit(url->ss);
-            errno = EIO;
-            return -1;
+        log_msg(L_DEBUG, "%s: %s: initializing SSL socket.\n", argv0, url->tname);
+        t = trace_now();
+        r = gnutls_init(&url->ss, GNUTLS_CLIENT);
+        if (!r) gnutls_session_set_ptr(url->ss, url); /* used in cert verifier */
+        if (!r) gnutls_server_name_set(url->ss, GNUTLS_NAME_DNS, url->host, strlen(url->host));
+        if (!r) r = gnutls_priority_set_direct(url->ss, ps, &errp);
+        if (!r) errp = NULL;
+        /* alternative to gnutls_priority_set_direct: if (!r) gnutls_set_default_priority(url->ss); */
+        if (!r) r = gnutls_credentials_set(url->ss, GNUTLS_CRD_CERTIFICATE, ssl_cred);
+        if (!r) ssl_session_resume(url);
+        if (!r) gnutls_transport_set_ptr(url->ss, (gnutls_transport_ptr_t) (intptr_t) url->sockfd);
+        if (!r) r = gnutls_handshake (url->ss);
+        do ; while ((r) && handle_ssl_error(url, &r, "opening SSL socket"));
+        if (r) {
+            close(url->sockfd);
+            if (errp) log_msg(L_ERROR, "%s: invalid SSL priority\n %s\n %*s\n", argv0, ps, (int)(errp - ps), "^");
+            log_msg(L_ERROR, "%s: %s: %s:%d:\n", argv0, url->tname, url->host, url->port);
+            ssl_error(r, url, "SSL connection failed");
+            log_msg(L_DEBUG, "%s: %s: closing SSL socket.\n", argv0, url->tname);
+            gnutls_deinit(url->ss);
+            errno = EIO;
+            return -1;
+        }
+        url->ssl_connected = 1; /* Prevent printing cert data over and over again */
+        if (gnutls_session_is_resumed(url->ss))
+            STAT_ADD(url, ST_TLS_RESUMED, 1);
+#ifdef USE_KTLS
+        ktls_setup(url);
+#endif
+        trace(TR_TLS, url, t, 0, 0, 0);
+    }
+#endif
+    return url->sock_type = SOCK_OPEN;
+}
+
+/*
+ * Temporary redirects of the master (-L). The mirror the master sent a
+ * url to is remembered for redirect_ttl seconds and later requests for
+ * the url go to the mirror directly, staying there across reconnects.
+ * When the master sent X-MD5 with the redirect the mirror has to send
+ * X-MD5 itself. A mirror that fails or answers with an error is dropped
+ * and the request goes to the master again. When a mirror sends no X-MD5
+ * the url keeps going through the master until the ttl has passed.
+ * The master is not asked for the ranges read from a remembered mirror,
+ * so their data is only checked against the X-MD5 of the mirror itself:
+ * -L trusts the mirrors, see the usage text and README.
+ */
+typedef struct redirect {
+    char * master;
+    char * location; /* NULL: the url needs the X-MD5 of the master */
+    time_t expires;
+    int md5;
+    struct redirect * next;
+} struct_redirect;
+
+static struct_redirect * redirects = NULL;
+#ifdef USE_THREAD
+pthread_mutex_t redirect_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static struct_redirect ** redirect_find(const char * master)
+{
+    struct_redirect ** r;
+    for (r = &redirects; *r; r = &(*r)->next)
+        if (!strcmp((*r)->master, master))
+            break;
+    return r;
+}
+
+static void redirect_store(struct_url * url, const char * location, int md5)
+{
+    struct_redirect ** r, * e;
+
+    if (!redirect_ttl)
+        return;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&redirect_lock);
+#endif
+    r = redirect_find(url->url);
+    if (!(e = *r)) {
+        e = *r = calloc(1, sizeof(struct_redirect));
+        e->master = strdup(url->url);
+    } else if (!e->location && time(NULL) < e->expires) {
+#ifdef USE_THREAD
+        pthread_mutex_unlock(&redirect_lock);
+#endif
+        return;
+    }
+    free(e->location);
+    e->location = strdup(location);
+    e->expires = time(NULL) + redirect_ttl;
+    e->md5 = md5;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&redirect_lock);
+#endif
+}
+
+/* Forget the mirror of the url and return to the master */
+static int redirect_drop(struct_url * url, const char * reason, int no_md5)
+{
+    struct_redirect ** r, * e;
+
+#ifdef USE_THREAD
+    pthread_mutex_lock(&redirect_lock);
+#endif
+    r = redirect_find(url->url);
+    if ((e = *r) && no_md5) {
+        free(e->location);
+        e->location = NULL;
+        e->expires = time(NULL) + redirect_ttl;
+    } else if (e) {
+        *r = e->next;
+        free(e->master);
+        free(e->location);
+        free(e);
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&redirect_lock);
+#endif
+    log_msg(L_INFO, "%s: %s: leaving mirror %s: %s\n", argv0, url->tname, url->host, reason);
+    url->redirect_cached = 0;
+    url->redirect_followed = 1;
+    return close_client_force(url);
+}
+
+/* Called before each request */
+static void redirect_apply(struct_url * url)
+{
+    struct_redirect * e;
+    char * location = NULL;
+    int md5 = 0;
+    time_t expires = 0, now;
+
+    if (!redirect_ttl)
+        return;
+    now = time(NULL);
+    if (url->redirect_cached) {
+        if (now >= url->redirect_expires) {
+            url->redirect_cached = 0;
+            url->redirect_followed = 1;
+            close_client_force(url);
         }
-        url->ssl_connected = 1; /* Prevent printing cert data over and over again */
+        return;
     }
+    if (url->redirected)
+        return;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&redirect_lock);
 #endif
-    return url->sock_type = SOCK_OPEN;
+    e = *redirect_find(url->url);
+    if (e && e->location && now < e->expires) {
+        location = strdup(e->location);
+        md5 = e->md5;
+        expires = e->expires;
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&redirect_lock);
+#endif
+    if (!location)
+        return;
+    if (parse_url(location, url, URL_DROP) < 0) {
+        parse_url(NULL, url, URL_DROP);
+    } else {
+        log_msg(L_DEBUG, "%s: %s: going to mirror %s directly\n", argv0, url->tname, location);
+        url->redirected = 1;
+        url->redirect_cached = 1;
+        url->redirect_md5 = md5;
+        url->redirect_expires = expires;
+        STAT_ADD(url, ST_REDIRECTS_CACHED, 1);
+    }
+    free(location);
 }
 
 static void
@@ -1746,9 +5522,8 @@ http_report(const char * reason, const char * method,
 {
     struct_url * url = thread_setup();
 
-    fprintf(stderr, "%s: %s: %s: %s\n", argv0, url->tname, method, reason);
-    fwrite(buf, len, 1, stderr);
-    if(len && ( *(buf+len-1) != '\n')) fputc('\n', stderr);
+    log_msg(L_WARN, "%s: %s: %s: %s\n%.*s%s", argv0, url->tname, method, reason,
+            (int)len, buf, (len && ( *(buf+len-1) != '\n')) ? "\n" : "");
 }
 
 /*
@@ -1769,7 +5544,7 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
     int status;
     const char * ptr = buf;
     const char * end;
-    int seen_accept = 0, seen_length = 0, seen_close = 0, seen_md5 = 0;
+    int seen_accept = 0, seen_length = 0, seen_close = 0, seen_md5 = 0, seen_etag = 0;
 
     if (bytes <= 0) {
         errno = EINVAL;
@@ -1824,20 +5599,23 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
                     return -1;
                 }
                 url->redirect_depth ++;
+                STAT_ADD(url, ST_REDIRECTS, 1);
                 if (url->redirect_depth > MAX_REDIRECTS) {
-                    fprintf(stderr, "%s: %s: server redirected %i times already. Giving up.", argv0, url->tname, MAX_REDIRECTS);
+                    log_msg(L_ERROR, "%s: %s: server redirected %i times already. Giving up.\n", argv0, url->tname, MAX_REDIRECTS);
                     errno = EIO;
                     if (tmp) free(tmp);
                     return -1;
                 }
 
                 if (status == 301 && url->redirect_depth == 1) { // change url permanently only if main server asked for it
-                    fprintf(stderr, "%s: %s: permanent redirect to %s\n", argv0, url->tname, tmp);
+                    log_msg(L_DEBUG, "%s: %s: permanent redirect to %s\n", argv0, url->tname, tmp);
 
                     res = parse_url(tmp, url, URL_SAVE);
                 } else {
-                    fprintf(stderr, "%s: %s: temporary redirect to %s\n", argv0, url->tname, tmp);
+                    log_msg(L_DEBUG, "%s: %s: temporary redirect to %s\n", argv0, url->tname, tmp);
 
+                    if (url->redirect_depth == 1)
+                        redirect_store(url, tmp, seen_md5);
                     url->redirected = 1;
                     res = parse_url(tmp, url, URL_DROP);
                     //free(tmp);
@@ -1849,7 +5627,7 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
                     return res;
                 }
 
-                print_url(stderr, url);
+                print_url(L_DEBUG, url);
                 return -EAGAIN;
             }
 
@@ -1860,8 +5638,8 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
                     url->xmd5[32] = 0;
                     seen_md5 = 1;
                 }
-                fprintf(stderr,"Is in redirect?: %s\n", url->redirected?"yes":"no");
-                fprintf(stderr,"X-MD5: %s\n", url->xmd5);
+                log_msg(L_DEBUG, "Is in redirect?: %s\n", url->redirected?"yes":"no");
+                log_msg(L_DEBUG, "X-MD5: %s\n", url->xmd5);
                 continue;
             }
             if (mempref(ptr, location, (size_t)(end - ptr), 0) ){
@@ -1904,10 +5682,31 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
             }
         }
     }
+    if (status == 304 && url->conditional && !strcmp(method, "HEAD")) {
+        url->not_modified = 1;
+        if (url->sock_type == SOCK_OPEN)
+            url->sock_type = SOCK_KEEPALIVE;
+        return header_len;
+    }
+    if (status == 200 && expect == 206 && url->conditional) {
+        /* If-Range did not match, the whole new file would follow */
+        log_msg(L_INFO, "%s: %s: %s changed on the server, dropping its cached blocks.\n",
+                argv0, url->tname, url->name ? url->name : url->path);
+        validator_drop(url);
+        STAT_ADD(url, ST_VALIDATOR_CHANGES, 1);
+        url->range_changed = 1;
+        close_client_force(url);
+        return -EAGAIN;
+    }
+    if (status != expect && url->redirect_cached) {
+        log_msg(L_WARN, "%s: %s: mirror failed with status: %d%.*s.\n",
+                argv0, method, status, (int)((end - ptr) - 1), ptr);
+        return redirect_drop(url, "error status", 0);
+    }
     if (status != expect) {
-        fprintf(stderr, "%s: %s: failed with status: %d%.*s.\n",
+        log_msg(L_ERROR, "%s: %s: failed with status: %d%.*s.\n",
                 argv0, method, status, (int)((end - ptr) - 1), ptr);
-        if (!strcmp("HEAD", method)) fwrite(buf, bytes, 1, stderr); /*DEBUG*/
+        if (!strcmp("HEAD", method)) log_msg(L_DEBUG, "%.*s", (int)bytes, buf);
         if (status == 404)
             errno = ENOENT;
         else
@@ -1919,16 +5718,20 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
     char * accept = "Accept-Ranges: bytes";
     char * range = "Content-Range: bytes";
     char * date = "Last-Modified: ";
+    char * etag = "ETag: ";
     char * close = "Connection: close";
     char * xmd5 = "X-MD5: ";
     struct tm tm;
+    url->validator[0] = 0;
     while(1)
     {
         ptr = end+1;
         if( !(ptr < buf + (header_len - 4))){
-            if(!seen_md5 && !url->redirected) url->xmd5[0]=0;
+            if(!seen_md5 && (!url->redirected || url->redirect_cached)) url->xmd5[0]=0;
+            if(!seen_md5 && url->redirect_cached && url->redirect_md5 && !strcmp(method, "GET"))
+                return redirect_drop(url, "no X-MD5", 1);
             if(seen_accept && seen_length){
-                if ( url->redirected ) url->sock_type = SOCK_OPEN; // don't continue with a mirror - need to get md5 from main server
+                if ( url->redirected && !url->redirect_cached ) url->sock_type = SOCK_OPEN; // don't continue with a mirror - need to get md5 from main server
                 else {
                     if(url->sock_type == SOCK_OPEN && !seen_close)
                         url->sock_type = SOCK_KEEPALIVE;
@@ -1958,12 +5761,13 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
         end = memchr(ptr, '\n', bytes - (size_t)(ptr - buf));
 
         if( mempref(ptr, xmd5, (size_t)(end - ptr), 0) ){
-            if ( !  url->redirected ){
+            if ( !  url->redirected || url->redirect_cached ){
                 strncpy(url->xmd5,(ptr + strlen(xmd5)), (size_t)(end - ptr) - strlen(xmd5)-1);
                 url->xmd5[32] = 0;
+                seen_md5 = 1;
             }
-            fprintf(stderr,"Is in redirect?: %s\n", url->redirected?"yes":"no");
-            fprintf(stderr,"X-MD5: %s\n", url->xmd5);
+            log_msg(L_DEBUG, "Is in redirect?: %s\n", url->redirected?"yes":"no");
+            log_msg(L_DEBUG, "X-MD5: %s\n", url->xmd5);
             continue;
         }
         if( mempref(ptr, content_length_str, (size_t)(end - ptr), 0)
@@ -1980,7 +5784,26 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
             seen_accept = 1;
             continue;
         }
+        if( mempref(ptr, etag, (size_t)(end - ptr), 0) ){
+            /* only strong ETags can be used with If-Range */
+            size_t len = (size_t)(end - ptr) - strlen(etag);
+            if (len && ptr[strlen(etag) + len - 1] == '\r')
+                len--;
+            if (ptr[strlen(etag)] == '"' && len < VALIDATOR_LEN) {
+                memcpy(url->validator, ptr + strlen(etag), len);
+                url->validator[len] = 0;
+                seen_etag = 1;
+            }
+            continue;
+        }
         if( mempref(ptr, date, (size_t)(end - ptr), 0) ){
+            size_t len = (size_t)(end - ptr) - strlen(date);
+            if (len && ptr[strlen(date) + len - 1] == '\r')
+                len--;
+            if (!seen_etag && len < VALIDATOR_LEN) {
+                memcpy(url->validator, ptr + strlen(date), len);
+                url->validator[len] = 0;
+            }
             memset(&tm, 0, sizeof(tm));
             if(!strptime(ptr + strlen(date),
                         "%n%a, %d %b %Y %T %Z", &tm)){
@@ -1998,6 +5821,165 @@ parse_header(struct_url *url, const char * buf, size_t bytes,
     }
 }
 
+// ========== HEDGING ============
+/*
+ * A Range request whose first response byte takes longer than the p95 of
+ * the last HEDGE_SAMPLES times to first byte, and at least hedge_ms, is
+ * sent once more on a second connection to the same server or mirror.
+ * The connection that starts answering first is kept and the other one
+ * closed, which aborts its request. A stall after the first byte is
+ * still only ended by the socket timeout.
+ */
+#define HEDGE_SAMPLES 64
+
+static uint64_t hedge_ttfb[HEDGE_SAMPLES];
+static unsigned hedge_count = 0;
+static uint64_t hedge_threshold = 0; /* microseconds, 0 until enough samples */
+#ifdef USE_THREAD
+pthread_mutex_t hedge_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int compare_u64(const void * a, const void * b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Add a time to first byte, the threshold is recomputed every 16 samples */
+static void hedge_sample(uint64_t ttfb)
+{
+    uint64_t sorted[HEDGE_SAMPLES];
+    unsigned n;
+
+    if (!hedge_ms)
+        return;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&hedge_lock);
+#endif
+    hedge_ttfb[hedge_count++ % HEDGE_SAMPLES] = ttfb;
+    if (!(hedge_count % 16)) {
+        n = hedge_count < HEDGE_SAMPLES ? hedge_count : HEDGE_SAMPLES;
+        memcpy(sorted, hedge_ttfb, n * sizeof(uint64_t));
+        qsort(sorted, n, sizeof(uint64_t), compare_u64);
+        hedge_threshold = sorted[n * 95 / 100];
+    }
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&hedge_lock);
+#endif
+}
+
+/* Exchange the connections of two urls */
+static void hedge_swap(struct_url * a, struct_url * b)
+{
+    struct_url t = *a;
+
+    a->sockfd = b->sockfd;
+    a->sock_type = b->sock_type;
+    a->io_timeout = b->io_timeout;
+    b->sockfd = t.sockfd;
+    b->sock_type = t.sock_type;
+    b->io_timeout = t.io_timeout;
+#ifdef USE_SSL
+    a->ss = b->ss;
+    a->ktls = b->ktls;
+    b->ss = t.ss;
+    b->ktls = t.ktls;
+    if (a->proto == PROTO_HTTPS) {
+        gnutls_session_set_ptr(a->ss, a);
+        gnutls_session_set_ptr(b->ss, b);
+    }
+#endif
+}
+
+/*
+ * Called with the request sent and in req. Returns when the connection
+ * of url has something to read, possibly after it was exchanged for the
+ * connection a second copy of the request was answered on first.
+ */
+
+static void hedge(struct_url * url, const char * req, size_t len)
+{
+    struct pollfd p[2];
+    uint64_t wait, start = now_us(), limit = (uint64_t)url->timeout * 1000000;
+    struct_url * h;
+    int res;
+
+    if (!hedge_ms)
+        return;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&hedge_lock);
+#endif
+    wait = hedge_threshold;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&hedge_lock);
+#endif
+    if (!wait)
+        return;
+    if (wait < (uint64_t)hedge_ms * 1000)
+        wait = (uint64_t)hedge_ms * 1000;
+#ifdef USE_SSL
+    if (url->proto == PROTO_HTTPS && !url->ktls && gnutls_record_check_pending(url->ss))
+        return;
+#endif
+    p[0].fd = url->sockfd;
+    p[0].events = POLLIN;
+    if (poll(p, 1, (int)(wait / 1000)) != 0)
+        return;
+
+    h = new_url(NULL);
+    h->proto = url->proto;
+    h->port = url->port;
+    h->host = strdup(url->host);
+    h->path = strdup(url->path);
+#ifdef USE_AUTH
+    if (url->auth)
+        h->auth = strdup(url->auth);
+#endif
+    h->stats = url->stats;
+    h->ino = url->ino;
+    /* the keepalive socket of url is the one still waiting for the reply */
+    h->own_socket = 1;
+    memcpy(h->tname, url->tname, TNAME_LEN + 1);
+    log_msg(L_DEBUG, "%s: %s: no reply after %" PRIu64 " ms, sending the request again.\n",
+            argv0, url->tname, (now_us() - start) / 1000);
+    if (write_client_socket(h, req, len) > 0) {
+        STAT_ADD(url, ST_HEDGES, 1);
+        p[1].fd = h->sockfd;
+        p[1].events = POLLIN;
+        do {
+            wait = now_us() - start;
+            res = poll(p, 2, wait < limit ? (int)((limit - wait) / 1000) : 0);
+        } while (res < 0 && errno == EINTR);
+        if (res > 0 && !p[0].revents && p[1].revents) {
+            log_msg(L_DEBUG, "%s: %s: the second request was answered first.\n", argv0, url->tname);
+            STAT_ADD(url, ST_HEDGE_WINS, 1);
+            hedge_swap(url, h);
+        }
+    }
+    free_url(h);
+    free(h);
+}
+
+/*
+ * Wait before reconnecting after the server reset the connection. The
+ * first retry goes out at once on a new connection, later ones wait
+ * 100 ms doubling up to RESET_BACKOFF_MS rather than whole seconds.
+ */
+
+static void reset_backoff(struct_url * url)
+{
+    long ms;
+
+    if (!url->resets)
+        return;
+    ms = 100L << (url->resets - 1);
+    if (ms > RESET_BACKOFF_MS || url->resets > 8)
+        ms = RESET_BACKOFF_MS;
+    poll(NULL, 0, (int)ms);
+}
+
+// ========== END HEDGING ============
+
 /*
  * Send the header, and get a reply.
  * This relies on 1k reads and writes being generally atomic -
@@ -2013,8 +5995,13 @@ exchange(struct_url *url, char * buf, const char * method,
     ssize_t res;
     size_t bytes;
     int range = (end > 0);
+    uint64_t ttfb, sent;
+    char tag[VALIDATOR_LEN];
+    off_t size;
 
+    url->range_changed = 0;
 req:
+    redirect_apply(url);
     /* Build request buffer, starting with the request method. */
 
     bytes = (size_t)snprintf(buf, HEADER_SIZE, "%s %s HTTP/1.1\r\nHost: %s\r\n",
@@ -2023,6 +6010,18 @@ req:
             "User-Agent: %s %s\r\n", __FILE__, VERSION);
     if (range) bytes += (size_t)snprintf(buf + bytes, HEADER_SIZE - bytes,
             "Range: bytes=%" PRIdMAX "-%" PRIdMAX "\r\n", (intmax_t)start, (intmax_t)end);
+    /* validators are only sent to the server they came from */
+    url->conditional = 0;
+    url->not_modified = 0;
+    if (!url->redirected && validator_get(url, tag, &size, NULL)) {
+        if (range)
+            bytes += (size_t)snprintf(buf + bytes, HEADER_SIZE - bytes,
+                    "If-Range: %s\r\n", tag);
+        else if (size >= 0 && !strcmp(method, "HEAD"))
+            bytes += (size_t)snprintf(buf + bytes, HEADER_SIZE - bytes,
+                    "%s: %s\r\n", tag[0] == '"' ? "If-None-Match" : "If-Modified-Since", tag);
+        url->conditional = range || (size >= 0 && !strcmp(method, "HEAD"));
+    }
 #ifdef USE_AUTH
     if ( url->auth )
         bytes += (size_t)snprintf(buf + bytes, HEADER_SIZE - bytes,
@@ -2046,13 +6045,15 @@ req:
 #define CONNFAIL ((res <= 0) && ! errno) || (errno == EAGAIN) || (errno == EPIPE)
 
         errno = 0;
+        ttfb = trace_now();
         res = write_client_socket(url, buf, bytes);
 
 #ifdef RETRY_ON_RESET
         if ((errno == ECONNRESET) && (url->resets < url->retry_reset)) {
-            errno_report("exchange: sleeping");
-            sleep(1U << url->resets);
+            errno_report("exchange: retrying");
+            reset_backoff(url);
             url->resets ++;
+            STAT_ADD(url, ST_RESETS, 1);
             if (close_client_force(url) == -EAGAIN)
                 goto req;
             continue;
@@ -2067,18 +6068,31 @@ req:
         }
         if (res <= 0){
             errno_report("exchange: failed to send request"); /* DEBUG */
+            if (url->redirect_cached && redirect_drop(url, "request failed", 0) == -EAGAIN)
+                goto req;
             if (close_client_force(url) == -EAGAIN)
                 goto req;
             if (!errno)
                 errno = EIO;
             return res;
         }
+        adapt_timeout(url, range ? (size_t)(end - start) + 1 : 0);
+        sent = now_us();
+        if (range)
+            hedge(url, buf, bytes);
         res = read_client_socket(url, buf, HEADER_SIZE);
+        if (res > 0) {
+            trace(TR_TTFB, url, ttfb, 0, start, 0);
+            adapt_rtt(url, now_us() - sent);
+            if (range)
+                hedge_sample(now_us() - sent);
+        }
 #ifdef RETRY_ON_RESET
         if ((errno == ECONNRESET) && (url->resets < url->retry_reset)) {
-            errno_report("exchange: sleeping");
-            sleep(1U << url->resets);
+            errno_report("exchange: retrying");
+            reset_backoff(url);
             url->resets ++;
+            STAT_ADD(url, ST_RESETS, 1);
             if (close_client_force(url) == -EAGAIN)
                 goto req;
             continue;
@@ -2087,11 +6101,14 @@ req:
 #endif
         if (CONNFAIL) {
             errno_report("exchange: did not receive a reply, retrying"); /* DEBUG */
+            adapt_expired(url);
             if (close_client_force(url) == -EAGAIN)
                 goto req;
             continue;
         } else if (res <= 0) {
             errno_report("exchange: failed receving reply from server"); /* DEBUG */
+            if (url->redirect_cached && redirect_drop(url, "no reply", 0) == -EAGAIN)
+                goto req;
             if (close_client_force(url) == -EAGAIN)
                 goto req;
             if (!errno)
@@ -2124,6 +6141,50 @@ req_header:
     }
 }
 
+/*
+ * Compare the result of the last HEAD with what was seen before and drop
+ * the kernel page cache of the file if it changed on the server, also
+ * when only its validator did.
+ */
+
+static void check_remote_change(struct_url *url, int changed)
+{
+    struct_file * f = node_get(url->ino);
+
+    if (!f)
+        return;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&files_lock);
+#endif
+    if (f->remote_size >= 0 && (f->remote_size != url->file_size
+                || f->remote_mtime != url->last_modified))
+        changed = 1;
+    f->remote_size = url->file_size;
+    f->remote_mtime = url->last_modified;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&files_lock);
+#endif
+    if (changed) {
+        log_msg(L_INFO, "%s: %s: remote file changed, invalidating page cache.\n", argv0, url->tname);
+        inval_add(url->ino);
+    }
+}
+
+/* Size of the file as last seen by any thread. */
+
+static off_t get_file_size(struct_file * f)
+{
+    off_t size;
+#ifdef USE_THREAD
+    pthread_mutex_lock(&files_lock);
+#endif
+    size = f->remote_size;
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&files_lock);
+#endif
+    return size;
+}
+
 /*
  * Function uses HEAD-HTTP-Request
  * to determine the file size
@@ -2131,17 +6192,184 @@ req_header:
 
 static off_t get_stat(struct_url *url, struct stat * stbuf) {
     char buf[HEADER_SIZE];
+    int changed = 0;
+
+    uint64_t t = now_us();
 
+    STAT_ADD(url, ST_REQUESTS, 1);
     if( exchange(url, buf, "HEAD", &(url->file_size), 0, 0, 0) < 0 )
         return -1;
+    stat_time(url, HI_EXCHANGE, t);
 
     close_client_socket(url);
+    if (url->not_modified) {
+        log_msg(L_DEBUG, "%s: %s: not modified.\n", argv0, url->tname);
+        validator_get(url, NULL, &url->file_size, &url->last_modified);
+        changed = 0;
+    } else if (!url->redirected)
+        changed = validator_check(url, 1);
+    if (changed) {
+        STAT_ADD(url, ST_VALIDATOR_CHANGES, 1);
+        delta_reuse(url);
+    }
+    check_remote_change(url, changed);
 
     stbuf->st_mtime = url->last_modified;
     return stbuf->st_size = url->file_size;
 }
 
 
+/*
+ * Delta reuse (-m suffix). When a file changed on the server the list of
+ * digests of its new version is fetched from the url with the suffix
+ * appended, one 'offset size md5' line per block. A cached block of the
+ * old version whose size and MD5 are in the list is kept as the block at
+ * the listed offset, so only the changed blocks are read again. The list
+ * should use the read size of the mount (-M, 128K by default) and
+ * aligned offsets for the blocks to match.
+ */
+#define DIGEST_LIST_MAX (64*1024*1024)
+
+typedef struct {
+    off_t off;
+    size_t size;
+    char md5[33];
+    int used; /* a stale block was moved here already */
+} struct_digest;
+
+static int compare_digest(const void * a, const void * b)
+{
+    return strcmp(((const struct_digest *)a)->md5, ((const struct_digest *)b)->md5);
+}
+
+/* The body of a GET of the whole file at location, NULL on failure */
+static char * fetch_all(struct_url * url, const char * location, size_t * len)
+{
+    char buf[HEADER_SIZE];
+    struct_url * u = new_url((char *)location);
+    off_t content_length;
+    size_t header_length;
+    ssize_t bytes;
+    char * data = NULL;
+
+    if (!u)
+        return NULL;
+    u->stats = url->stats;
+    memcpy(u->tname, url->tname, TNAME_LEN + 1);
+    STAT_ADD(url, ST_REQUESTS, 1);
+    bytes = exchange(u, buf, "GET", &content_length, 0, 0, &header_length);
+    if (bytes > 0 && content_length >= 0 && content_length <= DIGEST_LIST_MAX) {
+        size_t got = min((size_t)bytes - header_length, (size_t)content_length);
+        *len = (size_t)content_length;
+        if ((data = malloc(*len + 1)))
+            memcpy(data, buf + header_length, got);
+        while (data && got < *len) {
+            bytes = read_client_socket(u, data + got, *len - got);
+            if (bytes <= 0) {
+                free(data);
+                data = NULL;
+                break;
+            }
+            got += (size_t)bytes;
+        }
+        if (data)
+            data[*len] = 0;
+    }
+    free_url(u);
+    free(u);
+    return data;
+}
+
+/* Another current block of the file of p overlaps the range, cache_lock held */
+static int cache_covered(struct_range * p, off_t off, size_t size)
+{
+    struct_range * q;
+    for (q = idxhead; q; q = q->next)
+        if (q != p && q->fileid == p->fileid && !q->stale && q->size
+                && q->start < off + (off_t)size && off < q->start + (off_t)q->size)
+            return 1;
+    return 0;
+}
+
+static void delta_reuse(struct_url * url)
+{
+    struct_digest * digests = NULL, key, * d;
+    size_t len, count = 0, alloc = 0, reused = 0, stale = 0;
+    char * location, * list, * line;
+    struct_range * p;
+
+    if (!digest_suffix || fdcache <= 0)
+        return;
+    /* without a digest list the stale blocks are all dropped */
+    list = NULL;
+    if ((location = malloc(strlen(url->url) + strlen(digest_suffix) + 1))) {
+        strcpy(location, url->url);
+        strcat(location, digest_suffix);
+        list = fetch_all(url, location, &len);
+        if (!list)
+            log_msg(L_WARN, "%s: %s: no digest list at %s.\n", argv0, url->tname, location);
+        free(location);
+    }
+    for (line = list; line && *line; line += strcspn(line, "\n"), line += !!*line) {
+        intmax_t off;
+        if (count == alloc) {
+            size_t n = alloc ? alloc * 2 : 1024;
+            struct_digest * grown = realloc(digests, n * sizeof(struct_digest));
+            if (!grown) {
+                log_msg(L_WARN, "%s: %s: no memory for the digest list.\n", argv0, url->tname);
+                count = 0;
+                break;
+            }
+            digests = grown;
+            alloc = n;
+        }
+        d = &digests[count];
+        d->used = 0;
+        if (sscanf(line, "%jd %zu %32s", &off, &d->size, d->md5) == 3 && strlen(d->md5) == 32) {
+            d->off = (off_t)off;
+            count++;
+        }
+    }
+    free(list);
+    if (count)
+        qsort(digests, count, sizeof(struct_digest), compare_digest);
+
+#ifdef USE_THREAD
+    pthread_mutex_lock(&cache_lock);
+#endif
+    for (p = idxhead; p; p = p->next) {
+        if (p->fileid != url->fileid || !p->stale)
+            continue;
+        stale++;
+        p->stale = 0;
+        strcpy(key.md5, p->md5);
+        d = count ? bsearch(&key, digests, count, sizeof(struct_digest), compare_digest) : NULL;
+        /* the same content may be listed at several offsets, each one
+         * takes one block and only when the new version has none there */
+        while (d && d > digests && !strcmp(d[-1].md5, p->md5))
+            d--;
+        while (d && d < digests + count && !strcmp(d->md5, p->md5)
+                && (d->used || d->size != p->size || cache_covered(p, d->off, d->size)))
+            d++;
+        if (d && d < digests + count && !strcmp(d->md5, p->md5)) {
+            d->used = 1;
+            p->start = d->off;
+            reused++;
+        } else {
+            p->start = 0;
+            p->size = 0;
+        }
+    }
+    index_write();
+#ifdef USE_THREAD
+    pthread_mutex_unlock(&cache_lock);
+#endif
+    free(digests);
+    STAT_ADD(url, ST_DELTA_REUSED, reused);
+    log_msg(L_INFO, "%s: %s: kept %zu of %zu cached blocks of the old version.\n",
+            argv0, url->tname, reused, stale);
+}
+
 /*
  * get_data does all the magic
  * a GET-Request with Range-Header
@@ -2160,69 +6388,324 @@ static ssize_t get_data(struct_url *url, off_t start, size_t rsize)
     size_t header_length;
     MD5_CTX ctx;
     unsigned char xmd5[33]; // 32 digits + null terminator
-    size_t size;
+    char whole_md5[33]; /* X-MD5 of the first response */
+    int changed = 0;
+    size_t size, left, got;
+    uint64_t t, transfer, hash, h, body;
 
-    if (fdcache>0)
-        if ( (bytes = (ssize_t)get_cached(url, start, rsize)) == (ssize_t)rsize ) return (ssize_t)rsize;
+    if (fdcache>0) {
+        t = now_us();
+        bytes = (ssize_t)get_cached(url, start, rsize);
+        stat_time(url, HI_CACHE_READ, t);
+        trace(TR_CACHE_READ, url, t, 0, start, rsize);
+        if (bytes == (ssize_t)rsize) {
+            STAT_ADD(url, ST_CACHE_HIT, 1);
+            STAT_ADD(url, ST_BYTES_CACHE, rsize);
+            return (ssize_t)rsize;
+        }
+        /* get_cached only serves whole requests, a short count is a
+         * block found in the index whose data could not be read */
+        STAT_ADD(url, bytes > 0 ? ST_CACHE_ERRORS : ST_CACHE_MISS, 1);
+    }
 
+    sched_enter(url, rsize);
 retry:
     destination = url->req_buf;
     size = rsize;
+    transfer = trace_now();
+    hash = 0;
+    MD5_Init(&ctx);
+    body = now_us();
 
+    /*
+     * A response that ends early is resumed with a request for the rest
+     * as long as each response brings some data. The X-MD5 of the first
+     * response is kept, the ones of the resumed requests are only for
+     * their part and the hash goes on over the whole range.
+     */
+resume:
+    t = now_us();
+    STAT_ADD(url, ST_REQUESTS, 1);
     bytes = exchange(url, buf, "GET", &content_length,
-            start, end, &header_length);
-    if(bytes <= 0) return -1;
+            end + 1 - (off_t)size, end, &header_length);
+    if(bytes <= 0) {
+        sched_leave(url);
+        return -1;
+    }
+    stat_time(url, HI_EXCHANGE, t);
+    /* delta_reuse() follows when the read is done */
+    if (url->range_changed)
+        changed = 1;
+    /* the bytes of the old version read so far must not be mixed with
+     * the rest of the new one */
+    if (url->range_changed && size != rsize) {
+        log_msg(L_DEBUG, "%s: %s: changed while resuming, reading the range again.\n",
+                argv0, url->tname);
+        close_client_force(url);
+        goto retry;
+    }
+    /* the page cache is left alone, it cannot be dropped during a read */
+    if (!url->redirected && validator_check(url, 0)) {
+        STAT_ADD(url, ST_VALIDATOR_CHANGES, 1);
+        changed = 1;
+    }
+    if (size == rsize)
+        memcpy(whole_md5, url->xmd5, sizeof(whole_md5));
+    else
+        memcpy(url->xmd5, whole_md5, sizeof(whole_md5));
 
+    left = size;
     if (content_length != size) {
         http_report("didn't yield the whole piece.", "GET", 0, 0);
-        size = min((size_t)content_length, size);
+        left = min((size_t)content_length, size);
     }
 
 
     b = buf + header_length;
 
     bytes -= (b - buf);
+    if ((size_t)bytes > left)
+        bytes = (ssize_t)left;
     memcpy(destination, b, (size_t)bytes);
 
-    MD5_Init(&ctx);
+    h = trace_now();
     MD5_Update(&ctx, destination, (size_t)bytes);
+    if (h) hash += now_us() - h;
 
-    size -= (size_t)bytes;
-    destination +=bytes;
-    for (; size > 0; size -= (size_t)bytes, destination += bytes) {
+    got = (size_t)bytes;
+    for (; got < left; got += (size_t)bytes) {
 
-        bytes = read_client_socket(url, destination, size);
+        bytes = read_client_socket(url, destination + got, left - got);
         if (bytes < 0) {
             errno_report("GET (read)");
+            if (got || adapt_expired(url))
+                break;
+            sched_leave(url);
             return -1;
         }
         if (bytes == 0) {
             break;
         }
-        MD5_Update(&ctx, destination, (size_t)bytes);
+        h = trace_now();
+        MD5_Update(&ctx, destination + got, (size_t)bytes);
+        if (h) hash += now_us() - h;
+    }
+    size -= got;
+    destination += got;
+    if (size && (got || bytes < 0)) {
+        if (got < left)
+            close_client_force(url);
+        else
+            close_client_socket(url);
+        log_msg(L_DEBUG, "%s: %s: resuming the read with the last %zu bytes.\n",
+                argv0, url->tname, size);
+        STAT_ADD(url, ST_RESUMES, 1);
+        goto resume;
     }
 
     MD5_Final(xmd5,&ctx);
+    adapt_rate(url, (size_t)(destination - url->req_buf), now_us() - body);
+    trace(TR_TRANSFER, url, transfer, 0, start, rsize);
+    trace(TR_HASH, url, transfer, hash ? hash : 1, start, rsize);
 #if 1
 {
     int i;
     for(i = 0; i < 16; i++) sprintf((char*)(md5+(i<<1)), "%02x", xmd5[i]);
     md5[32]=0;
-    fprintf(stderr, "XMD5 : %s\n",(char*)url->xmd5);
-    fprintf(stderr, "MD5  : %s\n",md5);
+    log_msg(L_DEBUG, "XMD5 : %s\n",(char*)url->xmd5);
+    log_msg(L_DEBUG, "MD5  : %s\n",md5);
     if (strncmp((char*)url->xmd5, (char*)md5, 32) && url->xmd5[0]) {
         close_client_force(url);
+        STAT_ADD(url, ST_MD5_RETRIES, 1);
         goto retry;
     }
 }
 #endif
     close_client_socket(url);
+    sched_leave(url);
+    if (changed)
+        delta_reuse(url);
+    STAT_ADD(url, ST_BYTES_NET, rsize - size);
     if (fdcache>0) {
+        t = now_us();
         update_cache(url, start, rsize, md5);
+        stat_time(url, HI_CACHE_WRITE, t);
+        trace(TR_CACHE_WRITE, url, t, 0, start, rsize);
     }
     return (ssize_t)(end - start) + 1 - (ssize_t)size;
 }
 
+/*
+ * Zero copy reads (-s). Without a cache the body of a response on a
+ * plain socket is spliced into a pipe and from the pipe into the reply to
+ * the kernel, only the part read together with the header is copied.
+ * When the server sends X-MD5 the pipe is duplicated with tee() and the
+ * duplicate read and hashed, the reply is only sent when the digest
+ * matches. Returns 0 when the read is left to get_data(), also when
+ * something fails before the reply is sent.
+ */
+
+static void splice_close(struct_pipes * p)
+{
+    if (p->open) {
+        close(p->data[0]);
+        close(p->data[1]);
+        close(p->hash[0]);
+        close(p->hash[1]);
+        p->open = 0;
+    }
+}
+
+/* Pipes large enough for the whole read */
+static struct_pipes * splice_pipes(size_t size)
+{
+    struct_pipes * p = thread_pipes();
+
+    if (!p->open) {
+        if (pipe(p->data))
+            return NULL;
+        if (pipe(p->hash)) {
+            close(p->data[0]);
+            close(p->data[1]);
+            return NULL;
+        }
+        p->open = 1;
+    }
+    if ((fcntl(p->data[1], F_GETPIPE_SZ) < (int)size && fcntl(p->data[1], F_SETPIPE_SZ, (int)size) < 0)
+            || (fcntl(p->hash[1], F_GETPIPE_SZ) < (int)size && fcntl(p->hash[1], F_SETPIPE_SZ, (int)size) < 0)) {
+        log_msg(L_DEBUG, "%s: pipe size %zu: %s.\n", argv0, size, strerror(errno));
+        return NULL;
+    }
+    return p;
+}
+
+static int splice_socket(struct_url * url)
+{
+#ifdef USE_KTLS
+    if (url->ktls)
+        return 1;
+#endif
+    return url->proto == PROTO_HTTP;
+}
+
+static int splice_data(fuse_req_t req, struct_url * url, off_t start, size_t rsize)
+{
+    char buf[HEADER_SIZE];
+    char md5[33];
+    unsigned char xmd5[16];
+    struct {
+        struct fuse_bufvec v;
+        struct fuse_buf more;
+    } bufv;
+    struct_pipes * p;
+    off_t content_length;
+    size_t header_length, head, size, piped;
+    ssize_t bytes;
+    MD5_CTX ctx;
+    uint64_t t, h;
+    int i;
+
+    if (!splice_reads || fdcache > 0 || !splice_socket(url)
+            || !(p = splice_pipes(rsize)))
+        return 0;
+
+    t = now_us();
+    STAT_ADD(url, ST_REQUESTS, 1);
+    bytes = exchange(url, buf, "GET", &content_length,
+            start, start + (off_t)rsize - 1, &header_length);
+    if (bytes <= 0)
+        return 0;
+    stat_time(url, HI_EXCHANGE, t);
+    if (!splice_socket(url)) {
+        /* redirected to https */
+        close_client_force(url);
+        return 0;
+    }
+
+    size = min((size_t)content_length, rsize);
+    head = min((size_t)bytes - header_length, size);
+    t = now_us();
+    for (piped = 0; head + piped < size; piped += (size_t)bytes) {
+        bytes = splice(url->sockfd, NULL, p->data[1], NULL, size - head - piped, SPLICE_F_MOVE);
+        if (bytes < 0) {
+            errno_report("GET (splice)");
+            adapt_expired(url);
+            close_client_force(url);
+            splice_close(p);
+            return 0;
+        }
+        if (bytes == 0)
+            break;
+    }
+    if (head + piped < size) {
+        /* closed early, a short reply would read as the end of the file */
+        log_msg(L_DEBUG, "%s: %s: response ended early, reading again.\n", argv0, url->tname);
+        close_client_force(url);
+        splice_close(p);
+        return 0;
+    }
+    adapt_rate(url, piped, now_us() - t);
+    trace(TR_TRANSFER, url, t, 0, start, rsize);
+
+    if (url->xmd5[0]) {
+        char * data = url->req_buf;
+        size_t hashed;
+
+        h = trace_now();
+        MD5_Init(&ctx);
+        MD5_Update(&ctx, buf + header_length, head);
+        if (piped && tee(p->data[0], p->hash[1], piped, 0) != (ssize_t)piped) {
+            errno_report("GET (tee)");
+            close_client_force(url);
+            splice_close(p);
+            return 0;
+        }
+        for (hashed = 0; hashed < piped; hashed += (size_t)bytes) {
+            bytes = read(p->hash[0], data, piped - hashed);
+            if (bytes <= 0) {
+                close_client_force(url);
+                splice_close(p);
+                return 0;
+            }
+            MD5_Update(&ctx, data, (size_t)bytes);
+        }
+        MD5_Final(xmd5, &ctx);
+        trace(TR_HASH, url, h, 0, start, rsize);
+        for(i = 0; i < 16; i++) sprintf((char*)(md5+(i<<1)), "%02x", xmd5[i]);
+        md5[32]=0;
+        if (strncmp((char*)url->xmd5, md5, 32)) {
+            log_msg(L_DEBUG, "%s: %s: MD5 mismatch, reading again.\n", argv0, url->tname);
+            STAT_ADD(url, ST_MD5_RETRIES, 1);
+            close_client_force(url);
+            splice_close(p);
+            return 0;
+        }
+    }
+    close_client_socket(url);
+    STAT_ADD(url, ST_BYTES_NET, head + piped);
+
+    bufv.v = FUSE_BUFVEC_INIT(head);
+    bufv.v.buf[0].mem = buf + header_length;
+    if (piped) {
+        bufv.v.count = 2;
+        bufv.more.size = piped;
+        bufv.more.flags = FUSE_BUF_IS_FD;
+        bufv.more.fd = p->data[0];
+        bufv.more.pos = 0;
+        bufv.more.mem = NULL;
+        if (!head) {
+            bufv.v.buf[0] = bufv.more;
+            bufv.v.count = 1;
+        }
+    }
+    if (fuse_reply_data(req, &bufv.v, FUSE_BUF_SPLICE_MOVE) < 0) {
+        errno_report("reply (splice)");
+        splice_close(p);
+    }
+    return 1;
+}
+
+
 
 // ==============================================
 // MD5 extension